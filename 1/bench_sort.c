@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "sort.h"
+#include "../utils/vec.h"
+#include "../utils/heap_help/heap_help.h"
+
+/**
+ * Sort engine benchmark. Sorts the same random numbers with the
+ * old merge sort, which allocated a scratch vector in each merge,
+ * and with the ping-pong engine using each instruction set the CPU
+ * has, and with the radix sort, reporting time and the number of
+ * allocations of each. The radix sort is run on full range numbers
+ * and on numbers below 2^16 (generator.py -m 65535). By
+ * default the sizes are from 1K to 100M, the old sort is run only
+ * up to 1M - it is too slow after that.
+ *
+ * $> gcc -O2 bench_sort.c sort.c libcoro.c ../utils/heap_help/heap_help.c \
+ *        -ldl -pthread -o bench_sort
+ * $> ./bench_sort 1000 100000 1000000
+ */
+
+VEC_DECL(int_vec, int)
+
+/** The biggest input for the old sort. */
+#define OLD_SORT_MAX_COUNT 1000000
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** The merge of the sorter before the sort engine. */
+static void
+old_merge(struct int_vec *vector, int left, int mid, int right)
+{
+	int it1 = 0;
+	int it2 = 0;
+
+	struct int_vec result;
+	int_vec_create(&result);
+	int_vec_reserve(&result, vector->capacity);
+
+	while (left + it1 < mid && mid + it2 < right) {
+		if (vector->data[left + it1] < vector->data[mid + it2]) {
+			result.data[it1 + it2] = vector->data[left + it1];
+			it1 += 1;
+		} else {
+			result.data[it1 + it2] = vector->data[mid + it2];
+			it2 += 1;
+		}
+	}
+	while (left + it1 < mid) {
+		result.data[it1 + it2] = vector->data[left + it1];
+		it1 += 1;
+	}
+	while (mid + it2 < right) {
+		result.data[it1 + it2] = vector->data[mid + it2];
+		it2 += 1;
+	}
+	for (int i = 0; i < it1 + it2; ++i)
+		vector->data[left + i] = result.data[i];
+	int_vec_destroy(&result);
+}
+
+static void
+old_sort(struct int_vec *vector)
+{
+	int size = vector->size;
+	for (int i = 1; i < size; i *= 2) {
+		for (int j = 0; j < size - i; j += 2 * i) {
+			int right = j + 2 * i < size ? j + 2 * i : size;
+			old_merge(vector, j, j + i, right);
+		}
+		coro_yield_if_expired();
+	}
+}
+
+static void
+report(const char *name, int count, long long time, uint64_t allocs)
+{
+	printf("  %-8s %10.2f ms %8.2f M/s %10llu allocations\n", name,
+	       time / 1e6, count / (time / 1e3), (unsigned long long)allocs);
+}
+
+static void
+bench_radix(const char *name, int *work, int count, const int *expected)
+{
+	struct sort_buf buf;
+	sort_buf_create(&buf);
+	uint64_t allocs = heaph_get_alloc_total();
+	long long start = now_ns();
+	int *sorted = sort_radix(work, count, &buf);
+	long long time = now_ns() - start;
+	report(name, count, time, heaph_get_alloc_total() - allocs);
+	for (int i = 1; i < count; ++i) {
+		if (sorted[i - 1] > sorted[i]) {
+			printf("  not sorted!\n");
+			break;
+		}
+	}
+	if (expected != NULL &&
+	    memcmp(sorted, expected, count * sizeof(int)) != 0)
+		printf("  results differ!\n");
+	sort_buf_destroy(&buf);
+}
+
+static void
+bench(int count)
+{
+	int *numbers = malloc(count * sizeof(int));
+	for (int i = 0; i < count; ++i)
+		numbers[i] = rand();
+	int *work = malloc(count * sizeof(int));
+	int *expected = NULL;
+	printf("%d numbers:\n", count);
+
+	for (int isa = SORT_ISA_SCALAR; isa <= SORT_ISA_AVX2; ++isa) {
+		sort_set_isa(isa);
+		if ((int)sort_get_isa() != isa) {
+			printf("  %-8s not supported\n", sort_isa_name(isa));
+			continue;
+		}
+		memcpy(work, numbers, count * sizeof(int));
+		struct sort_buf buf;
+		sort_buf_create(&buf);
+		uint64_t allocs = heaph_get_alloc_total();
+		long long start = now_ns();
+		int *sorted = sort_merge(work, count, &buf);
+		long long time = now_ns() - start;
+		report(sort_isa_name(isa), count, time,
+		       heaph_get_alloc_total() - allocs);
+		if (expected == NULL) {
+			expected = malloc(count * sizeof(int));
+			memcpy(expected, sorted, count * sizeof(int));
+		} else if (memcmp(sorted, expected, count * sizeof(int)) != 0) {
+			printf("  results differ!\n");
+		}
+		sort_buf_destroy(&buf);
+	}
+	sort_set_isa(SORT_ISA_AVX2);
+
+	memcpy(work, numbers, count * sizeof(int));
+	bench_radix("radix", work, count, expected);
+	for (int i = 0; i < count; ++i)
+		work[i] = numbers[i] & 0xffff;
+	bench_radix("radix16", work, count, NULL);
+
+	if (count <= OLD_SORT_MAX_COUNT) {
+		struct int_vec old;
+		int_vec_create(&old);
+		int_vec_reserve(&old, count);
+		memcpy(old.data, numbers, count * sizeof(int));
+		old.size = count;
+		uint64_t allocs = heaph_get_alloc_total();
+		long long start = now_ns();
+		old_sort(&old);
+		long long time = now_ns() - start;
+		report("old", count, time, heaph_get_alloc_total() - allocs);
+		if (memcmp(old.data, expected, count * sizeof(int)) != 0)
+			printf("  results differ!\n");
+		int_vec_destroy(&old);
+	}
+	free(expected);
+	free(work);
+	free(numbers);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int default_counts[] = {
+		1000, 10000, 100000, 1000000, 10000000, 100000000,
+	};
+	/* The sort yields between passes, so it needs a scheduler. */
+	coro_sched_init(NULL);
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i)
+			bench(atoi(argv[i]));
+	} else {
+		int count = sizeof(default_counts) / sizeof(default_counts[0]);
+		for (int i = 0; i < count; ++i)
+			bench(default_counts[i]);
+	}
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+/**
+ * Coroutine switch benchmark. Creates N coroutines, each does M
+ * yields, and reports the cost of creation and of one switch.
+ *
+ * $> gcc -O2 bench_switch.c libcoro.c -o bench_switch
+ * $> ./bench_switch 10000 100
+ */
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+yield_loop(void *arg)
+{
+	int yield_count = *(int *)arg;
+	for (int i = 0; i < yield_count; ++i)
+		coro_yield();
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3) {
+		printf("Usage: %s <coro_count> <yield_count>\n", argv[0]);
+		return -1;
+	}
+	int coro_count = atoi(argv[1]);
+	int yield_count = atoi(argv[2]);
+
+	coro_sched_init(NULL);
+	long long start = now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(yield_loop, &yield_count);
+	long long created = now_ns();
+
+	long long switch_count = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switch_count += coro_switch_count(c);
+		coro_delete(c);
+	}
+	long long finished = now_ns();
+	coro_sched_destroy();
+
+	printf("coroutines: %d, yields each: %d\n", coro_count, yield_count);
+	printf("create: %.1f ns per coroutine\n",
+	       (double)(created - start) / coro_count);
+	printf("switches: %lld, %.1f ns per switch\n", switch_count,
+	       switch_count == 0 ? 0.0 :
+	       (double)(finished - created) / switch_count);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "num_writer.h"
+
+/**
+ * Number output benchmark. Writes the same random numbers as text
+ * with fprintf(), as the sorter used to, and with num_writer
+ * through the page cache and with O_DIRECT. Formatting alone, into
+ * memory, is measured too. The file is created in $TMPDIR, /tmp by
+ * default, and removed afterwards.
+ *
+ * $> gcc -O2 bench_write.c num_writer.c libcoro_io.c libcoro.c \
+ *        -pthread -o bench_write
+ * $> ./bench_write 10000000
+ */
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+report(const char *name, int count, long long time)
+{
+	printf("  %-12s %10.2f ms %8.2f M/s\n", name, time / 1e6,
+	       count / (time / 1e3));
+}
+
+static void
+bench_fprintf(const char *path, const int *numbers, int count)
+{
+	long long start = now_ns();
+	FILE *f = fopen(path, "w");
+	for (int i = 0; i < count; ++i)
+		fprintf(f, "%d ", numbers[i]);
+	fclose(f);
+	report("fprintf", count, now_ns() - start);
+}
+
+static void
+bench_format(const int *numbers, int count)
+{
+	char *buf = malloc((size_t)count * NUM_MAX_LEN);
+	long long start = now_ns();
+	char *p = buf;
+	for (int i = 0; i < count; ++i)
+		p = num_format(p, numbers[i]);
+	long long time = now_ns() - start;
+	/* Keep the result alive. */
+	if (p == buf)
+		printf("nothing formatted\n");
+	report("format only", count, time);
+	free(buf);
+}
+
+static void
+bench_writer(const char *name, const char *path, const int *numbers,
+	     int count, int flags)
+{
+	long long start = now_ns();
+	struct num_writer w;
+	if (num_writer_open(&w, path, flags) != 0) {
+		printf("  %-12s can not open %s\n", name, path);
+		return;
+	}
+	bool is_direct = w.is_direct;
+	/* By parts, as the merger does. */
+	for (int i = 0; i < count; i += 4096) {
+		int n = count - i < 4096 ? count - i : 4096;
+		num_writer_put(&w, numbers + i, n);
+	}
+	if (num_writer_close(&w) != 0)
+		printf("  %-12s write failed\n", name);
+	report(name, count, now_ns() - start);
+	if ((flags & NUM_WRITER_DIRECT) != 0 && !is_direct)
+		printf("  %-12s O_DIRECT is not supported, used the cache\n",
+		       name);
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 10000000;
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL)
+		dir = "/tmp";
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/bench_write.txt", dir);
+
+	int *numbers = malloc(count * sizeof(int));
+	for (int i = 0; i < count; ++i)
+		numbers[i] = rand();
+	printf("%d numbers:\n", count);
+	bench_fprintf(path, numbers, count);
+	bench_format(numbers, count);
+	bench_writer("num_writer", path, numbers, count, 0);
+	bench_writer("O_DIRECT", path, numbers, count, NUM_WRITER_DIRECT);
+	unlink(path);
+	free(numbers);
+	return 0;
+}
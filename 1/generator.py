@@ -1,5 +1,6 @@
 import random
 import argparse
+import array
 
 maxint = 1 << 31
 
@@ -7,9 +8,18 @@ parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-b', action='store_true', help='raw int32 numbers in '\
+					      'the host byte order')
 args = parser.parse_args()
 random.seed()
 
+if args.b:
+	numbers = array.array('i', (random.randint(0, min(args.m, maxint - 1))
+				    for i in range(0, args.c)))
+	f = open(args.f, 'wb')
+	numbers.tofile(f)
+	f.close()
+	exit(0)
 
 f = open(args.f, 'w')
 
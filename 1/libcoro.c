@@ -1,76 +1,534 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "libcoro.h"
 
+/*
+ * On x86-64 and aarch64 the context is switched by a small piece
+ * of assembly below: it saves callee-saved registers on the
+ * current stack, swaps stack pointers and restores the registers
+ * of the other side. New coroutines get their first frame built
+ * by hand. No syscalls neither on creation nor on a switch. On
+ * other platforms, or with CORO_USE_SIGALTSTACK defined, the
+ * portable sigaltstack + sigsetjmp/siglongjmp method is used.
+ */
+#if !defined(CORO_USE_SIGALTSTACK) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_USE_ASM 1
+#else
+#define CORO_USE_ASM 0
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/** Where a coroutine is in its life cycle. */
+enum coro_state {
+	/** Waits in the ready queue to be run. */
+	CORO_READY,
+	/** Works right now. */
+	CORO_RUNNING,
+	/** Sleeps in the blocked queue until coro_wakeup(). */
+	CORO_BLOCKED,
+	/** The function has returned, waits to be reaped. */
+	CORO_FINISHED,
+	/**
+	 * Flag, set by coro_wakeup() in the multi-thread mode, when
+	 * the coroutine is not blocked yet. The next coro_suspend()
+	 * returns right away then. It is kept in the same word as
+	 * the state, so a wakeup can not be lost between them.
+	 */
+	CORO_WAKEUP_PENDING = 0x10,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#if CORO_USE_ASM
+	/**
+	 * Stack pointer saved on the last switch out. All the
+	 * callee-saved registers are stored on the stack right
+	 * below it.
+	 */
+	void *sp;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
+#endif
+	/** Current state, defines which queue the coroutine is in. */
+	enum coro_state state;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Total time spent running, in nanoseconds. */
+	long long run_time;
+	/** When the coroutine got the CPU last time. */
+	long long switch_in_time;
+	/** Sequence number of the creation, for the profile. */
+	long long id;
+	const char *name;
+	long long create_time;
+	/** 0 while not finished. */
+	long long finish_time;
+	/** When the coroutine got into the ready queue. */
+	long long ready_time;
+	long long wait_time;
+	/** Thread CPU time at the last switch in, when profiling. */
+	long long cpu_in_time;
+	long long cpu_time;
+	long long slice_hist[CORO_SLICE_HIST_SIZE];
+	/**
+	 * How long the coroutine can run before
+	 * coro_yield_if_expired() yields, in nanoseconds.
+	 */
+	long long time_slice;
+	/** Links in the scheduler queue of the current state. */
 	struct coro *next, *prev;
 };
 
+/** Intrusive FIFO list of coroutines. */
+struct coro_queue {
+	struct coro *first;
+	struct coro *last;
+	int size;
+};
+
+/**
+ * Work-stealing deque of ready coroutines (Chase-Lev). Only the
+ * owner worker pushes, to the bottom. Everybody takes from the
+ * top, the owner too, so the coroutines are run in FIFO order.
+ */
+struct coro_deque {
+	long top;
+	long bottom;
+	struct coro **buf;
+};
+
+enum {
+	/** Capacity of a deque. Surplus goes to the inject queue. */
+	CORO_DEQUE_SIZE = 4096,
+};
+
+/** What to do with the previous coroutine right after a switch. */
+enum coro_post_op {
+	CORO_POST_NONE,
+	/** It has yielded, put it into the ready deque. */
+	CORO_POST_READY,
+	/** It has suspended, mark it blocked. */
+	CORO_POST_BLOCK,
+	/** It has finished, give it to coro_sched_wait(). */
+	CORO_POST_FINISH,
+};
+
+/** Scheduler of one thread. */
+struct coro_worker {
+	/**
+	 * Scheduler is a main coroutine - it catches and returns
+	 * dead ones to a user. For a worker thread it is the loop,
+	 * which picks coroutines to run.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_ptr;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_sched_waiting;
+	/*
+	 * Queues of the single-thread mode. The coroutines are
+	 * moved between them before a switch.
+	 */
+	/** Coroutines waiting for their turn to run. */
+	struct coro_queue ready;
+	/** Finished coroutines, not returned by coro_sched_wait() yet. */
+	struct coro_queue finished;
+	/** Coroutines suspended until an explicit wakeup. */
+	struct coro_queue blocked;
+	/*
+	 * Multi-thread mode. A coroutine can be seen by other
+	 * threads only when its context is saved. So the previous
+	 * coroutine is published by the next one, after the switch.
+	 */
+	/** Ready coroutines of this worker. */
+	struct coro_deque deque;
+	enum coro_post_op post_op;
+	struct coro *post_coro;
+	/** Seed to choose steal victims. */
+	unsigned seed;
+	pthread_t thread;
+};
+
+/** Scheduler of the thread, which has called coro_sched_init(). */
+static struct coro_worker coro_main_worker;
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Scheduler of the current thread. NULL in threads not created
+ * by the scheduler.
  */
-static struct coro coro_sched;
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+/** Worker threads of the multi-thread mode. */
+static struct coro_worker *coro_workers = NULL;
+/** Number of worker threads. 0 in the single-thread mode. */
+static int coro_worker_count = 0;
+
+/** State shared by the workers in the multi-thread mode. */
+static struct {
+	pthread_mutex_t mutex;
+	/** Signaled for idle workers when new work appears. */
+	pthread_cond_t work_cond;
+	/** Signaled when a coroutine has finished. */
+	pthread_cond_t finish_cond;
+	/**
+	 * Ready coroutines, which did not fit into a deque or were
+	 * woken up by a thread having no deque.
+	 */
+	struct coro_queue inject;
+	/** Size of the inject queue, to check it without the lock. */
+	int inject_count;
+	/** Finished coroutines, not returned by coro_sched_wait() yet. */
+	struct coro_queue finished;
+	/** Coroutines not returned by coro_sched_wait() yet. */
+	int live_count;
+	/** Number of workers sleeping on work_cond. */
+	int idle_count;
+	/** True, when the workers should exit. */
+	bool is_stopped;
+} coro_shared = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.finish_cond = PTHREAD_COND_INITIALIZER,
+};
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Scheduler of the current thread. Not inlined on purpose: after
+ * a switch a coroutine can continue in another thread, so the
+ * compiler must not reuse a thread-local address computed before
+ * the switch.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static __attribute__((noinline)) struct coro_worker *
+coro_worker_get(void)
+{
+	__asm__ __volatile__("");
+	return coro_worker_ptr;
+}
+
+/** Waits for external events when nobody is ready to run. */
+static coro_poll_f coro_poll = NULL;
+
+/** A deleted coroutine, waiting to be dumped. */
+struct coro_profile_entry {
+	long long id;
+	char *name;
+	struct coro_profile profile;
+	struct coro_profile_entry *next;
+};
+
+/** Profiling of the coroutines, see coro_sched_cfg.profile_path. */
+static struct {
+	/** Where to dump, NULL if profiling is off. */
+	char *path;
+	/** Deleted coroutines, the last deleted first. */
+	struct coro_profile_entry *entries;
+	pthread_mutex_t mutex;
+	long long next_id;
+	long long init_time;
+	long long time_slice;
+	int worker_count;
+} coro_prof = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+/** Time slice given to new coroutines. */
+static long long coro_time_slice_default = 0;
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Clock used for the time slices and run time accounting. It is
+ * read on every switch, so it must be cheap: the CPU counter
+ * where it runs at a constant rate, CLOCK_MONOTONIC_COARSE
+ * otherwise. Neither of them makes a syscall.
  */
-static sigjmp_buf start_point;
+#if defined(__x86_64__)
+
+/** Nanoseconds per TSC tick. 0, if TSC can not be used. */
+static double coro_tsc_ns_per_tick = 0;
+
+/**
+ * Check if TSC is invariant and measure its rate against
+ * CLOCK_MONOTONIC on a short interval.
+ */
+static void
+coro_clock_init(void)
+{
+	if (coro_tsc_ns_per_tick != 0)
+		return;
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & (1 << 8)) == 0)
+		return;
+	struct timespec ts1, ts2;
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	unsigned long long tsc1 = __rdtsc();
+	long long elapsed;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &ts2);
+		elapsed = (ts2.tv_sec - ts1.tv_sec) * 1000000000LL +
+			  ts2.tv_nsec - ts1.tv_nsec;
+	} while (elapsed < 2000000);
+	unsigned long long tsc2 = __rdtsc();
+	coro_tsc_ns_per_tick = (double)elapsed / (tsc2 - tsc1);
+}
+
+#elif defined(__aarch64__)
+
+/** Nanoseconds per tick of the generic timer. */
+static double coro_cntvct_ns_per_tick = 0;
+
+static void
+coro_clock_init(void)
+{
+	unsigned long long freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	coro_cntvct_ns_per_tick = 1e9 / freq;
+}
+
+#else
+
+static void
+coro_clock_init(void)
+{
+}
+
+#endif
+
+static inline long long
+coro_clock_ns(void)
+{
+#if defined(__x86_64__)
+	if (coro_tsc_ns_per_tick != 0)
+		return (long long)(__rdtsc() * coro_tsc_ns_per_tick);
+#elif defined(__aarch64__)
+	unsigned long long ticks;
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+	return (long long)(ticks * coro_cntvct_ns_per_tick);
+#endif
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Add the time since the last switch-in to the run time and
+ * start a new slice.
+ */
+static inline void
+coro_account(struct coro *c, long long now)
+{
+	long long slice = now - c->switch_in_time;
+	c->run_time += slice;
+	c->switch_in_time = now;
+	unsigned long long us = slice / 1000;
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= CORO_SLICE_HIST_SIZE)
+		bucket = CORO_SLICE_HIST_SIZE - 1;
+	++c->slice_hist[bucket];
+}
+
+/** CPU time of the current thread. Not cheap - a syscall. */
+static long long
+coro_thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum {
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	CORO_STACK_POOL_MAX_DEFAULT = 128,
+};
+
+/**
+ * Stacks of deleted coroutines, ready to be reused. They all have
+ * the same size, and their pages are already given back to the
+ * kernel, so cached stacks cost only address space.
+ */
+static struct {
+	/** Usable size of every stack. */
+	size_t stack_size;
+	/** Guard page size, it is placed below each stack. */
+	size_t guard_size;
+	/** Free stacks. */
+	void **stacks;
+	/** Number of free stacks. */
+	int count;
+	/** Maximal number of free stacks to keep. */
+	int max;
+	/** Coroutines are created and deleted by many threads. */
+	pthread_mutex_t mutex;
+} coro_stack_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Map a new stack with a PROT_NONE guard page below it, so a
+ * stack overflow is a segfault instead of a silent corruption of
+ * somebody else's memory.
+ */
+static void *
+coro_stack_map(void)
+{
+	size_t guard = coro_stack_pool.guard_size;
+	size_t size = coro_stack_pool.stack_size + guard;
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		handle_error();
+	if (mprotect(base, guard, PROT_NONE) != 0)
+		handle_error();
+	return base + guard;
+}
+
+static void
+coro_stack_unmap(void *stack)
+{
+	size_t guard = coro_stack_pool.guard_size;
+	if (munmap((char *)stack - guard,
+		   coro_stack_pool.stack_size + guard) != 0)
+		handle_error();
+}
+
+/** Take a stack from the pool, or map a new one. */
+static void *
+coro_stack_get(void)
+{
+	void *stack = NULL;
+	pthread_mutex_lock(&coro_stack_pool.mutex);
+	if (coro_stack_pool.count > 0)
+		stack = coro_stack_pool.stacks[--coro_stack_pool.count];
+	pthread_mutex_unlock(&coro_stack_pool.mutex);
+	return stack != NULL ? stack : coro_stack_map();
+}
+
+/**
+ * Return a stack to the pool. Its pages are dropped, so a reused
+ * stack costs only as much memory as its next owner touches.
+ */
+static void
+coro_stack_put(void *stack)
+{
+	if (madvise(stack, coro_stack_pool.stack_size, MADV_DONTNEED) != 0)
+		handle_error();
+	pthread_mutex_lock(&coro_stack_pool.mutex);
+	if (coro_stack_pool.count < coro_stack_pool.max) {
+		coro_stack_pool.stacks[coro_stack_pool.count++] = stack;
+		stack = NULL;
+	}
+	pthread_mutex_unlock(&coro_stack_pool.mutex);
+	if (stack != NULL)
+		coro_stack_unmap(stack);
+}
 
-/** Add a new coroutine to the beginning of the list. */
+/** Append a coroutine to the end of the queue. */
 static void
-coro_list_add(struct coro *c)
+coro_queue_push(struct coro_queue *q, struct coro *c)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+	++q->size;
 }
 
-/** Remove a coroutine from the list. */
+/** Remove a coroutine from an arbitrary place of the queue. */
 static void
-coro_list_delete(struct coro *c)
+coro_queue_delete(struct coro_queue *q, struct coro *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+	c->next = c->prev = NULL;
+	--q->size;
+}
+
+/** Take the first coroutine from the queue. NULL, if empty. */
+static struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_delete(q, c);
+	return c;
+}
+
+/** Push to the bottom. Only the owner can. False, if full. */
+static bool
+coro_deque_push(struct coro_deque *d, struct coro *c)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if (b - t >= CORO_DEQUE_SIZE)
+		return false;
+	__atomic_store_n(&d->buf[b & (CORO_DEQUE_SIZE - 1)], c,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/** Take from the top. Can be called by any thread. */
+static struct coro *
+coro_deque_steal(struct coro_deque *d)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	while (true) {
+		long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+		if (t >= b)
+			return NULL;
+		struct coro *c = __atomic_load_n(
+			&d->buf[t & (CORO_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			return c;
+	}
+}
+
+static bool
+coro_deque_is_empty(struct coro_deque *d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >=
+	       __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
 }
 
 int
@@ -85,71 +543,857 @@ coro_switch_count(const struct coro *c)
 	return c->switch_count;
 }
 
+long long
+coro_run_time(const struct coro *c)
+{
+	struct coro_worker *w = coro_worker_get();
+	if (w != NULL && c == w->this_ptr)
+		return c->run_time + coro_clock_ns() - c->switch_in_time;
+	return c->run_time;
+}
+
+void
+coro_get_profile(const struct coro *c, struct coro_profile *profile)
+{
+	long long end = c->finish_time != 0 ? c->finish_time : coro_clock_ns();
+	profile->wall_time = end - c->create_time;
+	profile->run_time = coro_run_time(c);
+	profile->cpu_time = c->cpu_time;
+	profile->wait_time = c->wait_time;
+	profile->switch_count = c->switch_count;
+	memcpy(profile->slice_hist, c->slice_hist, sizeof(c->slice_hist));
+}
+
+void
+coro_set_name(const char *name)
+{
+	coro_worker_get()->this_ptr->name = name;
+}
+
+void
+coro_set_time_slice(struct coro *c, long long time_slice)
+{
+	c->time_slice = time_slice;
+}
+
 bool
 coro_is_finished(const struct coro *c)
 {
-	return c->is_finished;
+	return __atomic_load_n(&c->state, __ATOMIC_ACQUIRE) == CORO_FINISHED;
 }
 
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	if (coro_prof.path != NULL) {
+		struct coro_profile_entry *e = malloc(sizeof(*e));
+		e->id = c->id;
+		e->name = c->name != NULL ? strdup(c->name) : NULL;
+		coro_get_profile(c, &e->profile);
+		pthread_mutex_lock(&coro_prof.mutex);
+		e->next = coro_prof.entries;
+		coro_prof.entries = e;
+		pthread_mutex_unlock(&coro_prof.mutex);
+	}
+	coro_stack_put(c->stack);
 	free(c);
 }
 
+static void
+coro_ctx_switch(struct coro *from, struct coro *to);
+
+/**
+ * Change the state of a coroutine in the multi-thread mode,
+ * keeping a pending wakeup, which can be set concurrently.
+ */
+static void
+coro_state_set(struct coro *c, enum coro_state state)
+{
+	enum coro_state old = __atomic_load_n(&c->state, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&c->state, &old,
+					    state | (old & CORO_WAKEUP_PENDING),
+					    false, __ATOMIC_SEQ_CST,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/** Wake up a worker, if some sleep. */
+static void
+coro_mt_notify(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_shared.idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&coro_shared.mutex);
+	pthread_cond_signal(&coro_shared.work_cond);
+	pthread_mutex_unlock(&coro_shared.mutex);
+}
+
+/**
+ * Make a coroutine runnable in the multi-thread mode. It goes to
+ * the deque of the current worker, or to the inject queue, if
+ * the current thread is not a worker.
+ */
+static void
+coro_mt_push(struct coro *c)
+{
+	struct coro_worker *w = coro_worker_get();
+	if (w == NULL || w->deque.buf == NULL ||
+	    !coro_deque_push(&w->deque, c)) {
+		pthread_mutex_lock(&coro_shared.mutex);
+		coro_queue_push(&coro_shared.inject, c);
+		__atomic_add_fetch(&coro_shared.inject_count, 1,
+				   __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&coro_shared.mutex);
+	}
+	coro_mt_notify();
+}
+
+static struct coro *
+coro_mt_pop_inject(void)
+{
+	if (__atomic_load_n(&coro_shared.inject_count, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+	pthread_mutex_lock(&coro_shared.mutex);
+	struct coro *c = coro_queue_pop(&coro_shared.inject);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_shared.inject_count, 1,
+				   __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&coro_shared.mutex);
+	return c;
+}
+
+/**
+ * Find the next coroutine to run: from the own deque, then from
+ * the inject queue, then steal from the other workers starting
+ * from a random one.
+ */
+static struct coro *
+coro_mt_next(struct coro_worker *w)
+{
+	struct coro *c = coro_deque_steal(&w->deque);
+	if (c != NULL)
+		return c;
+	c = coro_mt_pop_inject();
+	if (c != NULL)
+		return c;
+	int start = rand_r(&w->seed) % coro_worker_count;
+	for (int i = 0; i < coro_worker_count; ++i) {
+		struct coro_worker *victim =
+			&coro_workers[(start + i) % coro_worker_count];
+		if (victim == w)
+			continue;
+		c = coro_deque_steal(&victim->deque);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+static bool
+coro_mt_has_work(void)
+{
+	if (__atomic_load_n(&coro_shared.inject_count, __ATOMIC_SEQ_CST) != 0)
+		return true;
+	for (int i = 0; i < coro_worker_count; ++i) {
+		if (!coro_deque_is_empty(&coro_workers[i].deque))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Finish a switch on the new side: publish the previous
+ * coroutine, now when its context is saved.
+ */
+static void
+coro_switch_finish(void)
+{
+	struct coro_worker *w = coro_worker_get();
+	enum coro_post_op op = w->post_op;
+	if (op == CORO_POST_NONE)
+		return;
+	struct coro *c = w->post_coro;
+	w->post_op = CORO_POST_NONE;
+	w->post_coro = NULL;
+	switch (op) {
+	case CORO_POST_READY:
+		coro_state_set(c, CORO_READY);
+		coro_mt_push(c);
+		break;
+	case CORO_POST_BLOCK: {
+		/*
+		 * Once it is blocked, the coroutine belongs to its
+		 * waker and must not be touched here anymore. A
+		 * wakeup could come while it was still switching
+		 * out. Then the ready queue is up to us, and it has
+		 * been ready since the switch.
+		 */
+		enum coro_state running = CORO_RUNNING;
+		if (__atomic_compare_exchange_n(&c->state, &running,
+						CORO_BLOCKED, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			break;
+		__atomic_store_n(&c->state, CORO_READY, __ATOMIC_SEQ_CST);
+		coro_mt_push(c);
+		break;
+	}
+	case CORO_POST_FINISH:
+		pthread_mutex_lock(&coro_shared.mutex);
+		__atomic_store_n(&c->state, CORO_FINISHED, __ATOMIC_SEQ_CST);
+		coro_queue_push(&coro_shared.finished, c);
+		pthread_cond_signal(&coro_shared.finish_cond);
+		pthread_mutex_unlock(&coro_shared.mutex);
+		break;
+	default:
+		break;
+	}
+}
+
 /** Switch the current coroutine to an arbitrary one. */
 static void
 coro_yield_to(struct coro *to)
 {
-	struct coro *from = coro_this_ptr;
+	struct coro_worker *w = coro_worker_get();
+	struct coro *from = w->this_ptr;
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	long long now = coro_clock_ns();
+	coro_account(from, now);
+	/* Matters only if it goes to the ready queue. */
+	from->ready_time = now;
+	to->switch_in_time = now;
+	to->wait_time += now - to->ready_time;
+	if (coro_prof.path != NULL) {
+		long long cpu = coro_thread_cpu_ns();
+		from->cpu_time += cpu - from->cpu_in_time;
+		to->cpu_in_time = cpu;
+	}
+	if (coro_worker_count == 0)
+		to->state = CORO_RUNNING;
+	else
+		coro_state_set(to, CORO_RUNNING);
+	w->this_ptr = to;
+	coro_ctx_switch(from, to);
+	coro_switch_finish();
 }
 
 void
 coro_yield(void)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	struct coro_worker *w = coro_worker_get();
+	struct coro *from = w->this_ptr;
+	/* The scheduler is driven only by coro_sched_wait(). */
+	if (from == &w->sched)
+		return;
+	struct coro *to;
+	coro_poll_f poll = __atomic_load_n(&coro_poll, __ATOMIC_RELAXED);
+	if (coro_worker_count == 0) {
+		/* Let the ones waiting for events join the queue. */
+		if (w->blocked.size != 0 && poll != NULL)
+			poll(false);
+		to = coro_queue_pop(&w->ready);
+	} else {
+		if (poll != NULL)
+			poll(false);
+		to = coro_mt_next(w);
+	}
+	/* Nobody else wants to run - just continue. */
+	if (to == NULL) {
+		coro_account(from, coro_clock_ns());
+		return;
+	}
+	if (coro_worker_count == 0) {
+		from->state = CORO_READY;
+		coro_queue_push(&w->ready, from);
+	} else {
+		w->post_op = CORO_POST_READY;
+		w->post_coro = from;
+	}
+	coro_yield_to(to);
+}
+
+void
+coro_yield_if_expired(void)
+{
+	struct coro *c = coro_worker_get()->this_ptr;
+	if (coro_clock_ns() - c->switch_in_time >= c->time_slice)
+		coro_yield();
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_worker *w = coro_worker_get();
+	struct coro *from = w->this_ptr;
+	struct coro *to;
+	if (coro_worker_count == 0) {
+		from->state = CORO_BLOCKED;
+		coro_queue_push(&w->blocked, from);
+		to = coro_queue_pop(&w->ready);
+	} else {
+		/*
+		 * Only wakers can change the state now, and they only
+		 * add the flag.
+		 */
+		if (__atomic_load_n(&from->state, __ATOMIC_SEQ_CST) ==
+		    (CORO_RUNNING | CORO_WAKEUP_PENDING)) {
+			__atomic_store_n(&from->state, CORO_RUNNING,
+					 __ATOMIC_SEQ_CST);
+			return;
+		}
+		w->post_op = CORO_POST_BLOCK;
+		w->post_coro = from;
+		to = coro_mt_next(w);
+	}
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+		to = &w->sched;
+	coro_yield_to(to);
 }
 
 void
-coro_sched_init(void)
+coro_wakeup(struct coro *c)
+{
+	if (coro_worker_count == 0) {
+		if (c->state != CORO_BLOCKED)
+			return;
+		coro_queue_delete(&coro_main_worker.blocked, c);
+		c->state = CORO_READY;
+		c->ready_time = coro_clock_ns();
+		coro_queue_push(&coro_main_worker.ready, c);
+		return;
+	}
+	enum coro_state old = __atomic_load_n(&c->state, __ATOMIC_SEQ_CST);
+	while (true) {
+		if (old == CORO_BLOCKED) {
+			if (__atomic_compare_exchange_n(&c->state, &old,
+							CORO_READY, false,
+							__ATOMIC_SEQ_CST,
+							__ATOMIC_SEQ_CST)) {
+				/* Nobody can take it before the push. */
+				c->ready_time = coro_clock_ns();
+				coro_mt_push(c);
+				return;
+			}
+			continue;
+		}
+		if ((old & CORO_WAKEUP_PENDING) != 0 || old == CORO_FINISHED)
+			return;
+		if (__atomic_compare_exchange_n(&c->state, &old,
+						old | CORO_WAKEUP_PENDING,
+						false, __ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			return;
+	}
+}
+
+/** Prepare the scheduler of the current thread. */
+static void
+coro_worker_create(struct coro_worker *w)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	memset(w, 0, sizeof(*w));
+	w->sched.state = CORO_RUNNING;
+	w->sched.switch_in_time = coro_clock_ns();
+	w->sched.ready_time = w->sched.switch_in_time;
+	w->this_ptr = &w->sched;
+	w->seed = (unsigned)(uintptr_t)w;
 }
 
-struct coro *
-coro_sched_wait(void)
+/**
+ * Sleep until there is work for the worker. False, if the
+ * workers are stopped.
+ */
+static bool
+coro_worker_idle(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
+	coro_poll_f poll = __atomic_load_n(&coro_poll, __ATOMIC_RELAXED);
+	int pending = poll != NULL ? poll(false) : 0;
+	if (coro_mt_has_work())
+		return true;
+	bool is_stopped;
+	pthread_mutex_lock(&coro_shared.mutex);
+	__atomic_add_fetch(&coro_shared.idle_count, 1, __ATOMIC_SEQ_CST);
+	if (!coro_shared.is_stopped && !coro_mt_has_work()) {
+		if (pending > 0) {
+			/* Wake up soon to check the I/O again. */
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_nsec -= 1000000000;
+				++ts.tv_sec;
 			}
+			pthread_cond_timedwait(&coro_shared.work_cond,
+					       &coro_shared.mutex, &ts);
+		} else {
+			pthread_cond_wait(&coro_shared.work_cond,
+					  &coro_shared.mutex);
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
 	}
+	__atomic_sub_fetch(&coro_shared.idle_count, 1, __ATOMIC_SEQ_CST);
+	is_stopped = coro_shared.is_stopped;
+	pthread_mutex_unlock(&coro_shared.mutex);
+	return !is_stopped;
+}
+
+/** Scheduler loop of a worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_ptr = w;
+	w->this_ptr = &w->sched;
+	w->sched.switch_in_time = coro_clock_ns();
+	if (coro_prof.path != NULL)
+		w->sched.cpu_in_time = coro_thread_cpu_ns();
+	while (true) {
+		struct coro *c = coro_mt_next(w);
+		if (c != NULL)
+			coro_yield_to(c);
+		else if (!coro_worker_idle())
+			break;
+	}
+	coro_worker_ptr = NULL;
 	return NULL;
 }
 
+void
+coro_sched_init(const struct coro_sched_cfg *cfg)
+{
+	coro_sched_destroy();
+	coro_clock_init();
+	coro_worker_create(&coro_main_worker);
+	coro_worker_ptr = &coro_main_worker;
+	coro_time_slice_default = cfg != NULL ? cfg->time_slice : 0;
+	if (cfg != NULL && cfg->profile_path != NULL) {
+		coro_prof.path = strdup(cfg->profile_path);
+		coro_prof.next_id = 0;
+		coro_prof.init_time = coro_clock_ns();
+		coro_prof.time_slice = cfg->time_slice;
+		coro_prof.worker_count = cfg->worker_count > 1 ?
+					 cfg->worker_count : 1;
+		coro_main_worker.sched.cpu_in_time = coro_thread_cpu_ns();
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t stack_size = CORO_STACK_SIZE_DEFAULT;
+	int pool_max = CORO_STACK_POOL_MAX_DEFAULT;
+	if (cfg != NULL && cfg->stack_size != 0)
+		stack_size = cfg->stack_size;
+	if (cfg != NULL && cfg->stack_pool_max != 0)
+		pool_max = cfg->stack_pool_max;
+	if (stack_size < (size_t)SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	if (pool_max < 0)
+		pool_max = 0;
+	stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+	coro_stack_pool.stack_size = stack_size;
+	coro_stack_pool.guard_size = page_size;
+	coro_stack_pool.max = pool_max;
+	coro_stack_pool.stacks = malloc(pool_max * sizeof(void *));
+
+	int worker_count = cfg != NULL ? cfg->worker_count : 0;
+	if (worker_count <= 1)
+		return;
+	coro_shared.is_stopped = false;
+	coro_shared.live_count = 0;
+	coro_workers = calloc(worker_count, sizeof(*coro_workers));
+	coro_worker_count = worker_count;
+	for (int i = 0; i < worker_count; ++i) {
+		struct coro_worker *w = &coro_workers[i];
+		coro_worker_create(w);
+		w->deque.buf = calloc(CORO_DEQUE_SIZE, sizeof(struct coro *));
+	}
+	for (int i = 0; i < worker_count; ++i) {
+		if (pthread_create(&coro_workers[i].thread, NULL,
+				   coro_worker_f, &coro_workers[i]) != 0)
+			handle_error();
+	}
+}
+
+/** Write the profiles of the deleted coroutines as JSON and free them. */
+static void
+coro_profile_dump(void)
+{
+	FILE *f = fopen(coro_prof.path, "w");
+	if (f == NULL)
+		printf("Can not write the profile to %s\n", coro_prof.path);
+	/* The list is in reverse, turn it to the deletion order. */
+	struct coro_profile_entry *entries = NULL;
+	while (coro_prof.entries != NULL) {
+		struct coro_profile_entry *e = coro_prof.entries;
+		coro_prof.entries = e->next;
+		e->next = entries;
+		entries = e;
+	}
+	if (f != NULL) {
+		fprintf(f, "{\n  \"worker_count\": %d,\n"
+			"  \"time_slice_ns\": %lld,\n"
+			"  \"wall_time_ns\": %lld,\n"
+			"  \"coroutines\": [", coro_prof.worker_count,
+			coro_prof.time_slice,
+			coro_clock_ns() - coro_prof.init_time);
+	}
+	const char *sep = "\n";
+	while (entries != NULL) {
+		struct coro_profile_entry *e = entries;
+		entries = e->next;
+		const struct coro_profile *p = &e->profile;
+		if (f != NULL) {
+			fprintf(f, "%s    {\"id\": %lld, \"name\": \"%s\", "
+				"\"wall_time_ns\": %lld, \"run_time_ns\": %lld, "
+				"\"cpu_time_ns\": %lld, \"wait_time_ns\": %lld, "
+				"\"switch_count\": %lld, \"slice_hist\": [",
+				sep, e->id, e->name != NULL ? e->name : "",
+				p->wall_time, p->run_time, p->cpu_time,
+				p->wait_time, p->switch_count);
+			for (int i = 0; i < CORO_SLICE_HIST_SIZE; ++i) {
+				fprintf(f, i == 0 ? "%lld" : ", %lld",
+					p->slice_hist[i]);
+			}
+			fprintf(f, "]}");
+			sep = ",\n";
+		}
+		free(e->name);
+		free(e);
+	}
+	if (f != NULL) {
+		fprintf(f, "\n  ]\n}\n");
+		fclose(f);
+	}
+	free(coro_prof.path);
+	coro_prof.path = NULL;
+}
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_worker_count > 0) {
+		pthread_mutex_lock(&coro_shared.mutex);
+		coro_shared.is_stopped = true;
+		pthread_cond_broadcast(&coro_shared.work_cond);
+		pthread_mutex_unlock(&coro_shared.mutex);
+		for (int i = 0; i < coro_worker_count; ++i) {
+			pthread_join(coro_workers[i].thread, NULL);
+			free(coro_workers[i].deque.buf);
+		}
+		free(coro_workers);
+		coro_workers = NULL;
+		coro_worker_count = 0;
+	}
+	if (coro_prof.path != NULL)
+		coro_profile_dump();
+	for (int i = 0; i < coro_stack_pool.count; ++i)
+		coro_stack_unmap(coro_stack_pool.stacks[i]);
+	free(coro_stack_pool.stacks);
+	coro_stack_pool.stacks = NULL;
+	coro_stack_pool.count = 0;
+	coro_stack_pool.max = 0;
+}
+
+int
+coro_sched_worker_count(void)
+{
+	return coro_worker_count == 0 ? 1 : coro_worker_count;
+}
+
+/** coro_sched_wait() of the multi-thread mode. */
+static struct coro *
+coro_mt_wait(void)
+{
+	pthread_mutex_lock(&coro_shared.mutex);
+	while (coro_shared.finished.size == 0 && coro_shared.live_count > 0)
+		pthread_cond_wait(&coro_shared.finish_cond,
+				  &coro_shared.mutex);
+	struct coro *c = coro_queue_pop(&coro_shared.finished);
+	if (c != NULL)
+		--coro_shared.live_count;
+	pthread_mutex_unlock(&coro_shared.mutex);
+	return c;
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_worker_count > 0)
+		return coro_mt_wait();
+	struct coro_worker *w = &coro_main_worker;
+	while (true) {
+		struct coro *c = coro_queue_pop(&w->finished);
+		if (c != NULL)
+			return c;
+		c = coro_queue_pop(&w->ready);
+		if (c == NULL) {
+			if (w->blocked.size == 0)
+				return NULL;
+			/*
+			 * Everybody sleeps. Only an external event
+			 * can wake them up.
+			 */
+			if (coro_poll != NULL && coro_poll(true) > 0)
+				continue;
+			if (w->ready.size != 0)
+				continue;
+			printf("Critical error - all coroutines are "
+			       "blocked!\n");
+			exit(-1);
+		}
+		/*
+		 * The coroutines switch between each other directly.
+		 * The scheduler gets control back only when one of
+		 * them finishes or nobody is ready to run.
+		 */
+		w->is_sched_waiting = true;
+		coro_yield_to(c);
+		w->is_sched_waiting = false;
+	}
+}
+
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	struct coro_worker *w = coro_worker_get();
+	return w != NULL ? w->this_ptr : NULL;
+}
+
+bool
+coro_in_sched(void)
+{
+	struct coro_worker *w = coro_worker_get();
+	return w == NULL || w->this_ptr == &w->sched;
+}
+
+void
+coro_sched_set_poll(coro_poll_f poll)
+{
+	__atomic_store_n(&coro_poll, poll, __ATOMIC_RELAXED);
 }
 
+/**
+ * Coroutine entry point. Runs the function and never returns -
+ * the finished coroutine jumps back to the scheduler.
+ */
+static void
+coro_body(struct coro *c)
+{
+	coro_switch_finish();
+	c->ret = c->func(c->func_arg);
+	c->finish_time = coro_clock_ns();
+	struct coro_worker *w = coro_worker_get();
+	if (coro_worker_count > 0) {
+		w->post_op = CORO_POST_FINISH;
+		w->post_coro = c;
+		struct coro *to = coro_mt_next(w);
+		coro_yield_to(to != NULL ? to : &w->sched);
+	}
+	c->state = CORO_FINISHED;
+	coro_queue_push(&w->finished, c);
+	/* Can not return - 'ret' address is invalid already! */
+	if (! w->is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_yield_to(&w->sched);
+}
+
+#if CORO_USE_ASM
+
+#ifdef __APPLE__
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC(name) \
+	".globl " CORO_ASM_SYM(name) "\n" \
+	".private_extern " CORO_ASM_SYM(name) "\n" \
+	".p2align 4\n" \
+	CORO_ASM_SYM(name) ":\n"
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC(name) \
+	".globl " CORO_ASM_SYM(name) "\n" \
+	".hidden " CORO_ASM_SYM(name) "\n" \
+	".type " CORO_ASM_SYM(name) ", %function\n" \
+	".p2align 4\n" \
+	CORO_ASM_SYM(name) ":\n"
+#endif
+
+/**
+ * Save the callee-saved registers on the current stack, store
+ * the stack pointer into @a from_sp, load @a to_sp and restore
+ * the registers saved there. Returns into the other context.
+ */
+void
+coro_asm_switch(void **from_sp, void *to_sp);
+
+/**
+ * The first "return address" of a new coroutine. Takes the
+ * function and its argument from the restored callee-saved
+ * registers and calls it.
+ */
+void
+coro_asm_start(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout, from the saved stack pointer up: MXCSR and x87
+ * control word (8 bytes), r15, r14, r13, r12, rbx, rbp, return
+ * address.
+ */
+enum {
+	CORO_FRAME_CTRL,
+	CORO_FRAME_R15,
+	CORO_FRAME_R14,
+	CORO_FRAME_R13,
+	CORO_FRAME_R12,
+	CORO_FRAME_RBX,
+	CORO_FRAME_RBP,
+	CORO_FRAME_RET,
+	CORO_FRAME_SIZE,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_asm_switch)
+	"pushq %rbp\n"
+	"pushq %rbx\n"
+	"pushq %r12\n"
+	"pushq %r13\n"
+	"pushq %r14\n"
+	"pushq %r15\n"
+	"subq $8, %rsp\n"
+	"stmxcsr (%rsp)\n"
+	"fnstcw 4(%rsp)\n"
+	"movq %rsp, (%rdi)\n"
+	"movq %rsi, %rsp\n"
+	"ldmxcsr (%rsp)\n"
+	"fldcw 4(%rsp)\n"
+	"addq $8, %rsp\n"
+	"popq %r15\n"
+	"popq %r14\n"
+	"popq %r13\n"
+	"popq %r12\n"
+	"popq %rbx\n"
+	"popq %rbp\n"
+	"ret\n"
+
+	CORO_ASM_FUNC(coro_asm_start)
+	"movq %r12, %rdi\n"
+	"andq $-16, %rsp\n"
+	"callq *%r13\n"
+	"ud2\n"
+);
+
+/** Build the first frame, consumed by coro_asm_switch. */
+static void
+coro_ctx_make(struct coro *c)
+{
+	uintptr_t top = ((uintptr_t)c->stack + c->stack_size) &
+			~(uintptr_t)15;
+	uint64_t *frame = (uint64_t *)top - CORO_FRAME_SIZE;
+	memset(frame, 0, CORO_FRAME_SIZE * sizeof(*frame));
+	/* Default MXCSR and x87 control word. */
+	frame[CORO_FRAME_CTRL] = 0x1F80 | ((uint64_t)0x037F << 32);
+	frame[CORO_FRAME_R12] = (uintptr_t)c;
+	frame[CORO_FRAME_R13] = (uintptr_t)coro_body;
+	frame[CORO_FRAME_RET] = (uintptr_t)coro_asm_start;
+	c->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame layout, from the saved stack pointer up: x19-x28, x29
+ * (frame pointer), x30 (link register), d8-d15.
+ */
+enum {
+	CORO_FRAME_X19,
+	CORO_FRAME_X20,
+	CORO_FRAME_X29 = 10,
+	CORO_FRAME_X30,
+	CORO_FRAME_SIZE = 20,
+};
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC(coro_asm_switch)
+	"sub sp, sp, #160\n"
+	"stp x19, x20, [sp, #0]\n"
+	"stp x21, x22, [sp, #16]\n"
+	"stp x23, x24, [sp, #32]\n"
+	"stp x25, x26, [sp, #48]\n"
+	"stp x27, x28, [sp, #64]\n"
+	"stp x29, x30, [sp, #80]\n"
+	"stp d8, d9, [sp, #96]\n"
+	"stp d10, d11, [sp, #112]\n"
+	"stp d12, d13, [sp, #128]\n"
+	"stp d14, d15, [sp, #144]\n"
+	"mov x2, sp\n"
+	"str x2, [x0]\n"
+	"mov sp, x1\n"
+	"ldp x19, x20, [sp, #0]\n"
+	"ldp x21, x22, [sp, #16]\n"
+	"ldp x23, x24, [sp, #32]\n"
+	"ldp x25, x26, [sp, #48]\n"
+	"ldp x27, x28, [sp, #64]\n"
+	"ldp x29, x30, [sp, #80]\n"
+	"ldp d8, d9, [sp, #96]\n"
+	"ldp d10, d11, [sp, #112]\n"
+	"ldp d12, d13, [sp, #128]\n"
+	"ldp d14, d15, [sp, #144]\n"
+	"add sp, sp, #160\n"
+	"ret\n"
+
+	CORO_ASM_FUNC(coro_asm_start)
+	"mov x0, x19\n"
+	"blr x20\n"
+	"brk #0\n"
+);
+
+/** Build the first frame, consumed by coro_asm_switch. */
+static void
+coro_ctx_make(struct coro *c)
+{
+	uintptr_t top = ((uintptr_t)c->stack + c->stack_size) &
+			~(uintptr_t)15;
+	uint64_t *frame = (uint64_t *)top - CORO_FRAME_SIZE;
+	memset(frame, 0, CORO_FRAME_SIZE * sizeof(*frame));
+	frame[CORO_FRAME_X19] = (uintptr_t)c;
+	frame[CORO_FRAME_X20] = (uintptr_t)coro_body;
+	frame[CORO_FRAME_X30] = (uintptr_t)coro_asm_start;
+	c->sp = frame;
+}
+
+#endif /* defined(__aarch64__) */
+
+static void
+coro_ctx_switch(struct coro *from, struct coro *to)
+{
+	coro_asm_switch(&from->sp, to->sp);
+}
+
+#else /* !CORO_USE_ASM */
+
+static void
+coro_ctx_switch(struct coro *from, struct coro *to)
+{
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+}
+
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static sigjmp_buf start_point;
+/**
+ * Coroutine being created. The signal handler takes it from here.
+ * Creation changes process-wide signal settings, so it is done by
+ * one thread at a time.
+ */
+static struct coro *coro_signal_new = NULL;
+static pthread_mutex_t coro_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -157,10 +1401,11 @@ coro_this(void)
  * coroutine constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_signal_body(int signum)
 {
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	(void)signum;
+	struct coro *c = coro_signal_new;
+	coro_signal_new = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -171,30 +1416,17 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_body(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Create the first coroutine context on its stack using a signal
+ * handler, run on that stack via sigaltstack.
+ */
+static void
+coro_ctx_make(struct coro *c)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	pthread_mutex_lock(&coro_signal_mutex);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -202,7 +1434,7 @@ coro_new(coro_f func, void *func_arg)
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -210,7 +1442,7 @@ coro_new(coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = coro_signal_body;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
@@ -218,20 +1450,18 @@ coro_new(coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	coro_signal_new = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (coro_signal_new != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -248,10 +1478,45 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&coro_signal_mutex);
+}
 
+#endif /* !CORO_USE_ASM */
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	c->stack = coro_stack_get();
+	c->stack_size = coro_stack_pool.stack_size;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->state = CORO_READY;
+	c->switch_count = 0;
+	c->run_time = 0;
+	c->switch_in_time = 0;
+	c->time_slice = coro_time_slice_default;
+	c->id = __atomic_fetch_add(&coro_prof.next_id, 1, __ATOMIC_RELAXED);
+	c->name = NULL;
+	c->create_time = coro_clock_ns();
+	c->finish_time = 0;
+	c->ready_time = c->create_time;
+	c->wait_time = 0;
+	c->cpu_in_time = 0;
+	c->cpu_time = 0;
+	memset(c->slice_hist, 0, sizeof(c->slice_hist));
+	coro_ctx_make(c);
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	if (coro_worker_count == 0) {
+		coro_queue_push(&coro_main_worker.ready, c);
+		return c;
+	}
+	pthread_mutex_lock(&coro_shared.mutex);
+	++coro_shared.live_count;
+	pthread_mutex_unlock(&coro_shared.mutex);
+	coro_mt_push(c);
 	return c;
 }
@@ -1,25 +1,96 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/** Scheduler settings. Zero fields mean default values. */
+struct coro_sched_cfg {
+	/**
+	 * Usable stack size of each coroutine in bytes. Rounded up
+	 * to the page size. A guard page is added below it.
+	 */
+	size_t stack_size;
+	/**
+	 * How many stacks of deleted coroutines to keep for reuse.
+	 * Stacks beyond the limit are unmapped. Negative means no
+	 * caching at all.
+	 */
+	int stack_pool_max;
+	/**
+	 * Time slice of new coroutines in nanoseconds, see
+	 * coro_yield_if_expired().
+	 */
+	long long time_slice;
+	/**
+	 * Number of threads to run the coroutines. With 0 or 1 they
+	 * run in the thread calling coro_sched_wait(). With more,
+	 * each worker thread has its own scheduler, idle workers
+	 * steal ready coroutines from busy ones, and a coroutine
+	 * can continue in another thread after any switch.
+	 * coro_sched_wait() then only waits for finished ones.
+	 */
+	int worker_count;
+	/**
+	 * If set, the profiles of all the deleted coroutines are
+	 * written to this file as JSON by coro_sched_destroy(). The
+	 * CPU time of the coroutines is measured only then, it costs
+	 * a syscall per switch.
+	 */
+	const char *profile_path;
+};
+
+/**
+ * Make current context scheduler. @a cfg can be NULL to use the
+ * default settings.
+ */
+void
+coro_sched_init(const struct coro_sched_cfg *cfg);
+
+/**
+ * Stop the worker threads, release resources cached by the
+ * scheduler, like free stacks.
+ */
 void
-coro_sched_init(void);
+coro_sched_destroy(void);
+
+/** Number of threads running the coroutines. */
+int
+coro_sched_worker_count(void);
 
 /**
- * Block until any coroutine has finished. It is returned. NULl,
+ * Block until any coroutine has finished. It is returned. NULL,
  * if no coroutines.
  */
 struct coro *
 coro_sched_wait(void);
 
+/**
+ * A function to wait for external events, like I/O completions,
+ * which wake suspended coroutines up. With @a block false it only
+ * collects what is ready, otherwise waits for at least one event.
+ * Returns how many events are still expected.
+ */
+typedef int (*coro_poll_f)(bool block);
+
+/**
+ * Set a poll function. The scheduler calls it when nothing is
+ * ready to run, and on yields while there are suspended
+ * coroutines.
+ */
+void
+coro_sched_set_poll(coro_poll_f poll);
+
 /** Currently working coroutine. */
 struct coro *
 coro_this(void);
 
+/** True, if called from the scheduler, not from a coroutine. */
+bool
+coro_in_sched(void);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
@@ -34,14 +105,100 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * How long the coroutine has been running, in nanoseconds. Time
+ * spent waiting for its turn is not included.
+ */
+long long
+coro_run_time(const struct coro *c);
+
+enum {
+	/** Number of buckets in coro_profile.slice_hist. */
+	CORO_SLICE_HIST_SIZE = 24,
+};
+
+/** What a coroutine has spent its time on. Times are in nanoseconds. */
+struct coro_profile {
+	/** Since the creation till the finish, or till now. */
+	long long wall_time;
+	/** Time on a worker, as coro_run_time(). */
+	long long run_time;
+	/**
+	 * CPU time of the threads while they ran the coroutine. It
+	 * is less than run_time when the thread was preempted or
+	 * blocked in a syscall. 0, if not measured, see
+	 * coro_sched_cfg.profile_path.
+	 */
+	long long cpu_time;
+	/** Time spent ready to run, waiting for its turn. */
+	long long wait_time;
+	long long switch_count;
+	/**
+	 * Lengths of the slices - runs between the points where the
+	 * coroutine let others go, even if nobody wanted to. Bucket
+	 * 0 counts the slices shorter than 1us, bucket i - in
+	 * [2^(i-1), 2^i) us, the last one also all the longer ones.
+	 */
+	long long slice_hist[CORO_SLICE_HIST_SIZE];
+};
+
+/** Get the profile of the coroutine. */
+void
+coro_get_profile(const struct coro *c, struct coro_profile *profile);
+
+/**
+ * Name the current coroutine in the profile dump. The string is
+ * copied only when the coroutine is deleted, so it must live till
+ * then. It is done by the coroutine itself, because with several
+ * workers a new one can finish before coro_new() returns.
+ */
+void
+coro_set_name(const char *name);
+
+/** Set how long the coroutine can run before it should yield. */
+void
+coro_set_time_slice(struct coro *c, long long time_slice);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free the coroutine. Its stack is returned to the pool for
+ * reuse by new coroutines.
+ */
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next ready coroutine. The current one goes to the
+ * end of the ready queue. If no other coroutine is ready, returns
+ * right away.
+ */
 void
 coro_yield(void);
+
+/**
+ * Yield only if the current coroutine has been running for longer
+ * than its time slice since it got the CPU. Cheap enough to be
+ * called after each small piece of work.
+ */
+void
+coro_yield_if_expired(void);
+
+/**
+ * Suspend the current coroutine until somebody calls
+ * coro_wakeup() on it. Other ready coroutines run meanwhile.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run. Does nothing if it is
+ * not suspended. With several worker threads it can be called
+ * from any thread. Then a wakeup can also come slightly before
+ * the coroutine suspends, or be spurious, so the waiters should
+ * check their condition in a loop.
+ */
+void
+coro_wakeup(struct coro *c);
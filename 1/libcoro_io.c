@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "libcoro_io.h"
+
+#if defined(__linux__) && !defined(CORO_IO_NO_URING)
+#define CORO_IO_USE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#define CORO_IO_USE_URING 0
+#endif
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+enum coro_io_op {
+	CORO_IO_OPEN,
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+	CORO_IO_CLOSE,
+};
+
+/**
+ * One I/O operation. Lives on the stack of the coroutine, which
+ * waits for it.
+ */
+struct coro_io_req {
+	enum coro_io_op op;
+	int fd;
+	const char *path;
+	int flags;
+	mode_t mode;
+	void *buf;
+	size_t size;
+	off_t offset;
+	/** Result, or a negative error code. */
+	long long res;
+	/** True, when the result is delivered to the coroutine. */
+	bool is_done;
+	/**
+	 * True, when the completer does not touch the request and
+	 * the coroutine anymore. The waiter can return only then.
+	 */
+	bool is_released;
+	/** Coroutine to wake up on completion. */
+	struct coro *coro;
+	/** Link in the thread pool queues. */
+	struct coro_io_req *next;
+};
+
+/** Do the operation right now, blocking. */
+static long long
+coro_io_exec(struct coro_io_req *req)
+{
+	long long rc;
+	switch (req->op) {
+	case CORO_IO_OPEN:
+		rc = open(req->path, req->flags, req->mode);
+		break;
+	case CORO_IO_READ:
+		if (req->offset < 0)
+			rc = read(req->fd, req->buf, req->size);
+		else
+			rc = pread(req->fd, req->buf, req->size, req->offset);
+		break;
+	case CORO_IO_WRITE:
+		if (req->offset < 0)
+			rc = write(req->fd, req->buf, req->size);
+		else
+			rc = pwrite(req->fd, req->buf, req->size, req->offset);
+		break;
+	case CORO_IO_CLOSE:
+		rc = close(req->fd);
+		break;
+	default:
+		errno = EINVAL;
+		rc = -1;
+	}
+	return rc < 0 ? -errno : rc;
+}
+
+/**
+ * Number of operations submitted and not delivered yet. With
+ * several worker threads the results are delivered by whichever
+ * polls first.
+ */
+static int coro_io_pending = 0;
+/** True, when the backend is chosen and set up. */
+static bool coro_io_is_init = false;
+static pthread_mutex_t coro_io_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Deliver the result and wake the waiting coroutine up. */
+static void
+coro_io_complete(struct coro_io_req *req, long long res)
+{
+	struct coro *c = req->coro;
+	req->res = res;
+	__atomic_sub_fetch(&coro_io_pending, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&req->is_done, true, __ATOMIC_RELEASE);
+	coro_wakeup(c);
+	__atomic_store_n(&req->is_released, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Thread pool backend. Workers take requests from the submit
+ * queue, do them blocking and put into the done queue. The
+ * scheduler thread takes them from there in coro_io_poll().
+ */
+
+enum {
+	CORO_IO_THREAD_COUNT = 4,
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	/** Signaled when a new request is submitted. */
+	pthread_cond_t submit_cond;
+	/** Signaled when a request is done. */
+	pthread_cond_t done_cond;
+	struct coro_io_req *submit_first, *submit_last;
+	struct coro_io_req *done;
+	/** Number of done requests, to check without the lock. */
+	int done_count;
+	bool is_stopped;
+	pthread_t threads[CORO_IO_THREAD_COUNT];
+	int thread_count;
+} coro_io_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.submit_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+coro_io_pool_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_pool.mutex);
+	while (true) {
+		struct coro_io_req *req = coro_io_pool.submit_first;
+		if (req == NULL) {
+			if (coro_io_pool.is_stopped)
+				break;
+			pthread_cond_wait(&coro_io_pool.submit_cond,
+					  &coro_io_pool.mutex);
+			continue;
+		}
+		coro_io_pool.submit_first = req->next;
+		if (coro_io_pool.submit_first == NULL)
+			coro_io_pool.submit_last = NULL;
+		pthread_mutex_unlock(&coro_io_pool.mutex);
+
+		long long res = coro_io_exec(req);
+
+		pthread_mutex_lock(&coro_io_pool.mutex);
+		req->res = res;
+		req->next = coro_io_pool.done;
+		coro_io_pool.done = req;
+		__atomic_add_fetch(&coro_io_pool.done_count, 1,
+				   __ATOMIC_RELEASE);
+		pthread_cond_signal(&coro_io_pool.done_cond);
+	}
+	pthread_mutex_unlock(&coro_io_pool.mutex);
+	return NULL;
+}
+
+static void
+coro_io_pool_submit(struct coro_io_req *req)
+{
+	pthread_mutex_lock(&coro_io_pool.mutex);
+	if (coro_io_pool.thread_count == 0) {
+		coro_io_pool.is_stopped = false;
+		for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i) {
+			if (pthread_create(&coro_io_pool.threads[i], NULL,
+					   coro_io_pool_worker, NULL) != 0)
+				handle_error();
+		}
+		coro_io_pool.thread_count = CORO_IO_THREAD_COUNT;
+	}
+	req->next = NULL;
+	if (coro_io_pool.submit_last != NULL)
+		coro_io_pool.submit_last->next = req;
+	else
+		coro_io_pool.submit_first = req;
+	coro_io_pool.submit_last = req;
+	pthread_cond_signal(&coro_io_pool.submit_cond);
+	pthread_mutex_unlock(&coro_io_pool.mutex);
+}
+
+static void
+coro_io_pool_poll(bool block)
+{
+	if (!block && __atomic_load_n(&coro_io_pool.done_count,
+				      __ATOMIC_ACQUIRE) == 0)
+		return;
+	pthread_mutex_lock(&coro_io_pool.mutex);
+	while (block && coro_io_pool.done == NULL)
+		pthread_cond_wait(&coro_io_pool.done_cond,
+				  &coro_io_pool.mutex);
+	struct coro_io_req *req = coro_io_pool.done;
+	coro_io_pool.done = NULL;
+	__atomic_store_n(&coro_io_pool.done_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&coro_io_pool.mutex);
+	while (req != NULL) {
+		struct coro_io_req *next = req->next;
+		coro_io_complete(req, req->res);
+		req = next;
+	}
+}
+
+static void
+coro_io_pool_destroy(void)
+{
+	pthread_mutex_lock(&coro_io_pool.mutex);
+	coro_io_pool.is_stopped = true;
+	pthread_cond_broadcast(&coro_io_pool.submit_cond);
+	int count = coro_io_pool.thread_count;
+	coro_io_pool.thread_count = 0;
+	pthread_mutex_unlock(&coro_io_pool.mutex);
+	for (int i = 0; i < count; ++i)
+		pthread_join(coro_io_pool.threads[i], NULL);
+}
+
+#if CORO_IO_USE_URING
+
+/*
+ * io_uring backend, talking to the kernel via the raw syscalls.
+ * New requests are only put into the submission ring. They are
+ * passed to the kernel in a batch by the next poll, which happens
+ * when the scheduler has nothing else to do, or on a yield while
+ * somebody waits for I/O.
+ */
+
+enum {
+	CORO_URING_ENTRIES = 256,
+};
+
+static struct {
+	int fd;
+	/** Submission queue ring. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	/** Requests put into the ring, but not passed to the kernel. */
+	unsigned to_submit;
+	/** Completion queue ring. */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned cq_entries;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+} coro_uring = {
+	.fd = -1,
+};
+
+static int
+coro_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, coro_uring.fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+/** Set the ring up. False, if io_uring is not usable. */
+static bool
+coro_uring_init(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &p);
+	if (fd < 0)
+		return false;
+	/*
+	 * Reading at the current position and opening files came
+	 * in the same kernel version as this feature.
+	 */
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		close(fd);
+		return false;
+	}
+	coro_uring.fd = fd;
+	coro_uring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	coro_uring.cq_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (coro_uring.cq_size > coro_uring.sq_size)
+			coro_uring.sq_size = coro_uring.cq_size;
+		coro_uring.cq_size = coro_uring.sq_size;
+	}
+	coro_uring.sq_ptr = mmap(NULL, coro_uring.sq_size,
+				 PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, fd,
+				 IORING_OFF_SQ_RING);
+	if (coro_uring.sq_ptr == MAP_FAILED)
+		handle_error();
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		coro_uring.cq_ptr = coro_uring.sq_ptr;
+	} else {
+		coro_uring.cq_ptr = mmap(NULL, coro_uring.cq_size,
+					 PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, fd,
+					 IORING_OFF_CQ_RING);
+		if (coro_uring.cq_ptr == MAP_FAILED)
+			handle_error();
+	}
+	coro_uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	coro_uring.sqes = mmap(NULL, coro_uring.sqes_size,
+			       PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd,
+			       IORING_OFF_SQES);
+	if (coro_uring.sqes == MAP_FAILED)
+		handle_error();
+
+	char *sq = coro_uring.sq_ptr;
+	coro_uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	coro_uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	coro_uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	coro_uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	coro_uring.sq_entries = p.sq_entries;
+	char *cq = coro_uring.cq_ptr;
+	coro_uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	coro_uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	coro_uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	coro_uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	coro_uring.cq_entries = p.cq_entries;
+	coro_uring.to_submit = 0;
+	return true;
+}
+
+/** Pass the queued requests to the kernel, optionally wait. */
+static void
+coro_uring_flush(bool block)
+{
+	unsigned flags = block ? IORING_ENTER_GETEVENTS : 0;
+	if (coro_uring.to_submit == 0 && !block)
+		return;
+	int rc = coro_uring_enter(coro_uring.to_submit, block ? 1 : 0,
+				  flags);
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return;
+		handle_error();
+	}
+	if ((unsigned)rc > coro_uring.to_submit)
+		rc = coro_uring.to_submit;
+	coro_uring.to_submit -= rc;
+}
+
+static void
+coro_uring_reap(void)
+{
+	unsigned head = *coro_uring.cq_head;
+	unsigned tail = __atomic_load_n(coro_uring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe =
+			&coro_uring.cqes[head & *coro_uring.cq_mask];
+		struct coro_io_req *req =
+			(struct coro_io_req *)(uintptr_t)cqe->user_data;
+		++head;
+		coro_io_complete(req, cqe->res);
+	}
+	__atomic_store_n(coro_uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+coro_uring_poll(bool block)
+{
+	coro_uring_flush(block);
+	coro_uring_reap();
+}
+
+static void
+coro_uring_submit(struct coro_io_req *req)
+{
+	/*
+	 * Keep the completions in the ring bounds, and free a
+	 * submission slot if all are taken. The kernel may refuse the
+	 * submission with EAGAIN or EBUSY while its completions are not
+	 * reaped, so reap and retry until a slot is free.
+	 */
+	while (__atomic_load_n(&coro_io_pending, __ATOMIC_RELAXED) >
+	       (int)coro_uring.cq_entries)
+		coro_uring_poll(true);
+	while (coro_uring.to_submit == coro_uring.sq_entries)
+		coro_uring_poll(true);
+
+	unsigned tail = *coro_uring.sq_tail;
+	unsigned idx = tail & *coro_uring.sq_mask;
+	struct io_uring_sqe *sqe = &coro_uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = req->fd;
+	sqe->user_data = (uintptr_t)req;
+	switch (req->op) {
+	case CORO_IO_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)req->path;
+		sqe->len = req->mode;
+		sqe->open_flags = req->flags;
+		break;
+	case CORO_IO_READ:
+	case CORO_IO_WRITE:
+		sqe->opcode = req->op == CORO_IO_READ ? IORING_OP_READ :
+			      IORING_OP_WRITE;
+		sqe->addr = (uintptr_t)req->buf;
+		sqe->len = req->size;
+		sqe->off = req->offset < 0 ? (uint64_t)-1 :
+			   (uint64_t)req->offset;
+		break;
+	case CORO_IO_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		break;
+	}
+	coro_uring.sq_array[idx] = idx;
+	__atomic_store_n(coro_uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++coro_uring.to_submit;
+}
+
+static void
+coro_uring_destroy(void)
+{
+	if (coro_uring.fd < 0)
+		return;
+	munmap(coro_uring.sqes, coro_uring.sqes_size);
+	if (coro_uring.cq_ptr != coro_uring.sq_ptr)
+		munmap(coro_uring.cq_ptr, coro_uring.cq_size);
+	munmap(coro_uring.sq_ptr, coro_uring.sq_size);
+	close(coro_uring.fd);
+	coro_uring.fd = -1;
+}
+
+#endif /* CORO_IO_USE_URING */
+
+#if CORO_IO_USE_URING
+/** True, if io_uring is used, false for the thread pool. */
+static bool coro_io_use_uring = false;
+#endif
+
+/** Scheduler poll hook, see coro_sched_set_poll(). */
+static int
+coro_io_poll(bool block)
+{
+	if (__atomic_load_n(&coro_io_pending, __ATOMIC_RELAXED) == 0)
+		return 0;
+#if CORO_IO_USE_URING
+	if (coro_io_use_uring)
+		coro_uring_poll(block);
+	else
+#endif
+		coro_io_pool_poll(block);
+	return __atomic_load_n(&coro_io_pending, __ATOMIC_RELAXED);
+}
+
+/**
+ * Submit the request and sleep until it is done. Outside of a
+ * coroutine it is executed right away.
+ */
+static long long
+coro_io_call(struct coro_io_req *req)
+{
+	if (coro_in_sched())
+		return coro_io_exec(req);
+	if (!__atomic_load_n(&coro_io_is_init, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&coro_io_init_mutex);
+		if (!coro_io_is_init) {
+#if CORO_IO_USE_URING
+			/*
+			 * The ring is not thread-safe, so the worker
+			 * threads share the thread pool instead.
+			 */
+			if (coro_sched_worker_count() == 1)
+				coro_io_use_uring = coro_uring_init();
+#endif
+			coro_sched_set_poll(coro_io_poll);
+			__atomic_store_n(&coro_io_is_init, true,
+					 __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&coro_io_init_mutex);
+	}
+	req->is_done = false;
+	req->is_released = false;
+	req->coro = coro_this();
+	__atomic_add_fetch(&coro_io_pending, 1, __ATOMIC_RELAXED);
+#if CORO_IO_USE_URING
+	if (coro_io_use_uring)
+		coro_uring_submit(req);
+	else
+#endif
+		coro_io_pool_submit(req);
+	while (!__atomic_load_n(&req->is_done, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	/*
+	 * With several worker threads the coroutine can see the
+	 * result while the completer is still waking it up.
+	 */
+	while (!__atomic_load_n(&req->is_released, __ATOMIC_ACQUIRE))
+		sched_yield();
+	return req->res;
+}
+
+/** Convert a negative error code into -1 and errno. */
+static long long
+coro_io_result(long long res)
+{
+	if (res >= 0)
+		return res;
+	errno = -res;
+	return -1;
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_io_req req = {
+		.op = CORO_IO_OPEN,
+		.fd = -1,
+		.path = path,
+		.flags = flags,
+		.mode = mode,
+	};
+	return coro_io_result(coro_io_call(&req));
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size, off_t offset)
+{
+	struct coro_io_req req = {
+		.op = CORO_IO_READ,
+		.fd = fd,
+		.buf = buf,
+		.size = size,
+		.offset = offset,
+	};
+	return coro_io_result(coro_io_call(&req));
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size, off_t offset)
+{
+	struct coro_io_req req = {
+		.op = CORO_IO_WRITE,
+		.fd = fd,
+		.buf = (void *)buf,
+		.size = size,
+		.offset = offset,
+	};
+	return coro_io_result(coro_io_call(&req));
+}
+
+int
+coro_close(int fd)
+{
+	struct coro_io_req req = {
+		.op = CORO_IO_CLOSE,
+		.fd = fd,
+	};
+	return coro_io_result(coro_io_call(&req));
+}
+
+void
+coro_io_destroy(void)
+{
+	if (!coro_io_is_init)
+		return;
+#if CORO_IO_USE_URING
+	coro_uring_destroy();
+#endif
+	coro_io_pool_destroy();
+	coro_sched_set_poll(NULL);
+	coro_io_is_init = false;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <sys/types.h>
+
+/**
+ * Coroutine-aware file I/O. Each call submits the operation and
+ * suspends the calling coroutine until it is complete, so other
+ * coroutines keep running meanwhile. Completions are collected
+ * by the scheduler, which wakes the waiting coroutines up.
+ *
+ * Linux io_uring is used when available, otherwise the blocking
+ * syscalls are done by a small thread pool. Outside of a
+ * coroutine the calls are just blocking syscalls.
+ *
+ * Return values and errno are the same as of the corresponding
+ * syscalls.
+ */
+
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+/**
+ * Read from the given offset. Offset -1 means the current file
+ * position, like read().
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size, off_t offset);
+
+/**
+ * Write at the given offset. Offset -1 means the current file
+ * position, like write().
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t size, off_t offset);
+
+int
+coro_close(int fd);
+
+/** Stop the I/O threads, close the ring. */
+void
+coro_io_destroy(void);
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include "libcoro.h"
+#include "libcoro_sync.h"
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+/*
+ * Each object is protected by a spinlock. It is held only for a
+ * few instructions and never over a coroutine switch, so it does
+ * not need anything heavier. In the single-threaded scheduler it
+ * is never contended.
+ *
+ * A waiter lives on the stack of the suspended coroutine. The
+ * waker removes it from the queue and wakes the coroutine up
+ * still holding the lock. The woken coroutine takes the lock
+ * before returning, so the waker is guaranteed to be done with
+ * the waiter and the coroutine by then.
+ */
+
+/** A coroutine sleeping in a wait queue. */
+struct coro_waiter {
+	struct coro *coro;
+	/** Set by the waker, under the object lock. */
+	bool is_woken;
+	struct coro_waiter *next;
+};
+
+static inline void
+coro_spin_lock(bool *lock)
+{
+	int spin_count = 0;
+	while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+		if (++spin_count == 100) {
+			spin_count = 0;
+			sched_yield();
+		}
+	}
+}
+
+static inline void
+coro_spin_unlock(bool *lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static void
+coro_wait_queue_push(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (q->last == NULL)
+		q->first = w;
+	else
+		q->last->next = w;
+	q->last = w;
+}
+
+/** Wake up the oldest waiter. False, if there are none. */
+static bool
+coro_wait_queue_wake_one(struct coro_wait_queue *q)
+{
+	struct coro_waiter *w = q->first;
+	if (w == NULL)
+		return false;
+	q->first = w->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	__atomic_store_n(&w->is_woken, true, __ATOMIC_RELEASE);
+	coro_wakeup(w->coro);
+	return true;
+}
+
+static void
+coro_wait_queue_wake_all(struct coro_wait_queue *q)
+{
+	while (coro_wait_queue_wake_one(q))
+		;
+}
+
+/**
+ * Put the current coroutine into the queue. Must be called with
+ * the lock taken.
+ */
+static inline void
+coro_waiter_add(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+	w->coro = coro_this();
+	w->is_woken = false;
+	coro_wait_queue_push(q, w);
+}
+
+/**
+ * Sleep until the waiter is woken up, then take the lock. Must be
+ * called without the lock.
+ */
+static inline void
+coro_waiter_sleep(struct coro_waiter *w, bool *lock)
+{
+	while (!__atomic_load_n(&w->is_woken, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	coro_spin_lock(lock);
+}
+
+/** Release the lock, sleep in the queue, take the lock back. */
+static void
+coro_wait(struct coro_wait_queue *q, bool *lock)
+{
+	struct coro_waiter w;
+	coro_waiter_add(q, &w);
+	coro_spin_unlock(lock);
+	coro_waiter_sleep(&w, lock);
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	coro_spin_lock(&m->lock);
+	while (m->is_locked)
+		coro_wait(&m->waiters, &m->lock);
+	m->is_locked = true;
+	coro_spin_unlock(&m->lock);
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_spin_lock(&m->lock);
+	m->is_locked = false;
+	coro_wait_queue_wake_one(&m->waiters);
+	coro_spin_unlock(&m->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	struct coro_waiter w;
+	coro_spin_lock(&c->lock);
+	coro_waiter_add(&c->waiters, &w);
+	coro_spin_unlock(&c->lock);
+	/*
+	 * The waiter is queued before the mutex is released, so a
+	 * signal sent right after that is not lost.
+	 */
+	coro_mutex_unlock(m);
+	coro_waiter_sleep(&w, &c->lock);
+	coro_spin_unlock(&c->lock);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	coro_spin_lock(&c->lock);
+	coro_wait_queue_wake_one(&c->waiters);
+	coro_spin_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	coro_spin_lock(&c->lock);
+	coro_wait_queue_wake_all(&c->waiters);
+	coro_spin_unlock(&c->lock);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *wg)
+{
+	memset(wg, 0, sizeof(*wg));
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count)
+{
+	coro_spin_lock(&wg->lock);
+	wg->count += count;
+	if (wg->count == 0)
+		coro_wait_queue_wake_all(&wg->waiters);
+	coro_spin_unlock(&wg->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	coro_spin_lock(&wg->lock);
+	while (wg->count > 0)
+		coro_wait(&wg->waiters, &wg->lock);
+	coro_spin_unlock(&wg->lock);
+}
+
+void
+coro_channel_create(struct coro_channel *ch, int capacity)
+{
+	memset(ch, 0, sizeof(*ch));
+	ch->capacity = capacity;
+	ch->size = capacity > 0 ? capacity : 16;
+	ch->buf = malloc(ch->size * sizeof(ch->buf[0]));
+	if (ch->buf == NULL)
+		handle_error();
+}
+
+void
+coro_channel_destroy(struct coro_channel *ch)
+{
+	free(ch->buf);
+}
+
+/** Double the ring buffer of an unbounded channel. */
+static void
+coro_channel_grow(struct coro_channel *ch)
+{
+	int new_size = ch->size * 2;
+	void **new_buf = malloc(new_size * sizeof(new_buf[0]));
+	if (new_buf == NULL)
+		handle_error();
+	for (int i = 0; i < ch->count; ++i)
+		new_buf[i] = ch->buf[(ch->begin + i) % ch->size];
+	free(ch->buf);
+	ch->buf = new_buf;
+	ch->size = new_size;
+	ch->begin = 0;
+}
+
+int
+coro_channel_put(struct coro_channel *ch, void *data)
+{
+	coro_spin_lock(&ch->lock);
+	while (!ch->is_closed && ch->capacity > 0 &&
+	       ch->count == ch->capacity)
+		coro_wait(&ch->writers, &ch->lock);
+	if (ch->is_closed) {
+		coro_spin_unlock(&ch->lock);
+		return -1;
+	}
+	if (ch->count == ch->size)
+		coro_channel_grow(ch);
+	ch->buf[(ch->begin + ch->count) % ch->size] = data;
+	++ch->count;
+	coro_wait_queue_wake_one(&ch->readers);
+	coro_spin_unlock(&ch->lock);
+	return 0;
+}
+
+int
+coro_channel_get(struct coro_channel *ch, void **data)
+{
+	coro_spin_lock(&ch->lock);
+	while (!ch->is_closed && ch->count == 0)
+		coro_wait(&ch->readers, &ch->lock);
+	if (ch->count == 0) {
+		coro_spin_unlock(&ch->lock);
+		return -1;
+	}
+	*data = ch->buf[ch->begin];
+	ch->begin = (ch->begin + 1) % ch->size;
+	--ch->count;
+	coro_wait_queue_wake_one(&ch->writers);
+	coro_spin_unlock(&ch->lock);
+	return 0;
+}
+
+void
+coro_channel_close(struct coro_channel *ch)
+{
+	coro_spin_lock(&ch->lock);
+	ch->is_closed = true;
+	coro_wait_queue_wake_all(&ch->readers);
+	coro_wait_queue_wake_all(&ch->writers);
+	coro_spin_unlock(&ch->lock);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Synchronization of coroutines. A coroutine, which has to wait,
+ * is suspended and put into a wait queue of the object, instead
+ * of spinning in coro_yield(). It is woken up when the object
+ * changes. All the objects can be used by coroutines running in
+ * different worker threads.
+ *
+ * The calls, which can sleep, are allowed only in coroutines.
+ * Those which never sleep (unlock, signal, done, close, put into
+ * an unbounded channel) can be called from the scheduler too.
+ */
+
+struct coro_waiter;
+
+/** FIFO of suspended coroutines. */
+struct coro_wait_queue {
+	struct coro_waiter *first;
+	struct coro_waiter *last;
+};
+
+/** Mutex. Only coroutines can lock it. */
+struct coro_mutex {
+	/** Spinlock protecting the fields. Never held over a switch. */
+	bool lock;
+	bool is_locked;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable, used together with a coro_mutex. */
+struct coro_cond {
+	bool lock;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *c);
+
+/**
+ * Unlock the mutex, sleep until a signal, lock the mutex back.
+ * Like with pthread, the condition should be checked in a loop.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up one waiter. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Wait until a counter of unfinished jobs drops to zero. */
+struct coro_wait_group {
+	bool lock;
+	int count;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *wg);
+
+/** Add @a count jobs to wait for. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count);
+
+/** One job is done. The waiters are woken up on the last one. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/** Sleep until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * FIFO channel of pointers. A bounded one suspends writers while
+ * it is full. An unbounded one grows instead. Readers are
+ * suspended while it is empty.
+ */
+struct coro_channel {
+	bool lock;
+	/** Ring buffer of the messages. */
+	void **buf;
+	/** Allocated size of buf. */
+	int size;
+	/** Max number of messages in the buffer. 0 - unbounded. */
+	int capacity;
+	/** Index of the first message. */
+	int begin;
+	/** Number of messages. */
+	int count;
+	/** True, if no new messages are accepted. */
+	bool is_closed;
+	struct coro_wait_queue readers;
+	struct coro_wait_queue writers;
+};
+
+/**
+ * Create a channel, holding up to @a capacity messages. Capacity
+ * 0 means unbounded.
+ */
+void
+coro_channel_create(struct coro_channel *ch, int capacity);
+
+void
+coro_channel_destroy(struct coro_channel *ch);
+
+/**
+ * Put a message. Suspends while a bounded channel is full.
+ * Returns -1, if the channel is closed.
+ */
+int
+coro_channel_put(struct coro_channel *ch, void *data);
+
+/**
+ * Take the oldest message. Suspends while the channel is empty.
+ * Returns -1, if the channel is closed and empty.
+ */
+int
+coro_channel_get(struct coro_channel *ch, void **data);
+
+/**
+ * Stop accepting new messages, wake up everybody waiting. The
+ * messages already in the channel still can be read.
+ */
+void
+coro_channel_close(struct coro_channel *ch);
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include "libcoro_io.h"
+#include "num_writer.h"
+
+enum {
+	/** Big enough to make a syscall per 100K numbers or so. */
+	NUM_WRITER_BUF_SIZE = 1024 * 1024,
+	/** Buffer, offset and size alignment of O_DIRECT writes. */
+	NUM_WRITER_ALIGN = 4096,
+};
+
+/** "00", "01", ..., "99" - two digits at a time. */
+static const char num_digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const uint32_t num_pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000,
+};
+
+/**
+ * Number of decimal digits. log2 is one instruction, log10 is
+ * about log2 * 1233 / 4096, off by one at most.
+ */
+static inline int
+num_digit_count(uint32_t v)
+{
+	/* 0 has 1 digit, and v | 1 never crosses a power of 10. */
+	uint32_t u = v | 1;
+	int t = ((32 - __builtin_clz(u)) * 1233) >> 12;
+	return t + (u >= num_pow10[t]);
+}
+
+/**
+ * The digits are written right to left into their final place, so
+ * there is no temporary buffer to copy from. Four digits are split
+ * off per division, the two pairs of them do not depend on each
+ * other.
+ */
+static inline char *
+num_format_inline(char *p, int value)
+{
+	uint32_t v = value;
+	if (value < 0) {
+		*p++ = '-';
+		v = 0u - v;
+	}
+	char *end = p + num_digit_count(v);
+	char *t = end;
+	while (v >= 10000) {
+		uint32_t r = v % 10000;
+		v /= 10000;
+		t -= 4;
+		memcpy(t, &num_digit_pairs[(r / 100) * 2], 2);
+		memcpy(t + 2, &num_digit_pairs[(r % 100) * 2], 2);
+	}
+	if (v >= 100) {
+		t -= 2;
+		memcpy(t, &num_digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10)
+		memcpy(t - 2, &num_digit_pairs[v * 2], 2);
+	else
+		t[-1] = '0' + v;
+	*end = ' ';
+	return end + 1;
+}
+
+char *
+num_format(char *p, int value)
+{
+	return num_format_inline(p, value);
+}
+
+/** Go on through the page cache, after O_DIRECT has failed. */
+static void
+num_writer_drop_direct(struct num_writer *w)
+{
+	int fl = fcntl(w->fd, F_GETFL);
+	if (fl >= 0)
+		fcntl(w->fd, F_SETFL, fl & ~O_DIRECT);
+	w->is_direct = false;
+}
+
+/**
+ * Write the buffer out. With O_DIRECT only whole blocks are
+ * written, unless @a is_final, and the tail is moved to the
+ * beginning of the buffer.
+ */
+static void
+num_writer_flush(struct num_writer *w, bool is_final)
+{
+	if (w->is_direct && is_final)
+		num_writer_drop_direct(w);
+	size_t size = w->used;
+	if (w->is_direct)
+		size &= ~(size_t)(NUM_WRITER_ALIGN - 1);
+	size_t done = 0;
+	while (done < size && w->rc == 0) {
+		ssize_t rc = coro_write(w->fd, w->buf + done, size - done,
+					w->offset + done);
+		if (rc > 0) {
+			done += rc;
+		} else if (rc < 0 && errno == EINVAL && w->is_direct) {
+			/* Stricter alignment than expected. */
+			num_writer_drop_direct(w);
+		} else {
+			w->rc = -1;
+		}
+	}
+	if (w->rc != 0) {
+		w->used = 0;
+		return;
+	}
+	w->used -= done;
+	w->offset += done;
+	memmove(w->buf, w->buf + done, w->used);
+}
+
+int
+num_writer_open(struct num_writer *w, const char *path, int flags)
+{
+	int open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	w->is_direct = (flags & NUM_WRITER_DIRECT) != 0;
+	w->fd = -1;
+	if (w->is_direct)
+		w->fd = coro_open(path, open_flags | O_DIRECT, 0644);
+	if (w->fd < 0) {
+		w->is_direct = false;
+		w->fd = coro_open(path, open_flags, 0644);
+		if (w->fd < 0)
+			return -1;
+	}
+	if (posix_memalign((void **)&w->buf, NUM_WRITER_ALIGN,
+			   NUM_WRITER_BUF_SIZE) != 0) {
+		coro_close(w->fd);
+		return -1;
+	}
+	w->size = NUM_WRITER_BUF_SIZE;
+	w->used = 0;
+	w->offset = 0;
+	w->rc = 0;
+	return 0;
+}
+
+void
+num_writer_put(struct num_writer *w, const int *numbers, size_t count)
+{
+	char *pos = w->buf + w->used;
+	char *limit = w->buf + w->size - NUM_MAX_LEN;
+	for (size_t i = 0; i < count; ++i) {
+		if (pos > limit) {
+			w->used = pos - w->buf;
+			num_writer_flush(w, false);
+			pos = w->buf + w->used;
+		}
+		pos = num_format_inline(pos, numbers[i]);
+	}
+	w->used = pos - w->buf;
+}
+
+int
+num_writer_close(struct num_writer *w)
+{
+	num_writer_flush(w, true);
+	free(w->buf);
+	if (coro_close(w->fd) != 0)
+		w->rc = -1;
+	return w->rc;
+}
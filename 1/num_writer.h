@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Buffered writer of numbers as text, separated by spaces. The
+ * numbers are formatted two digits at a time straight into a big
+ * page-aligned buffer, which is written out with coro_write() at
+ * explicit offsets. It works both in coroutines and outside of
+ * them, see libcoro_io.h.
+ */
+
+enum num_writer_flags {
+	/**
+	 * Bypass the page cache with O_DIRECT. Only whole blocks
+	 * are written this way, the tail is written through the
+	 * cache on close. If the file system does not support
+	 * O_DIRECT, the writer silently uses the cache.
+	 */
+	NUM_WRITER_DIRECT = 1,
+};
+
+struct num_writer {
+	int fd;
+	/** Page-aligned for O_DIRECT. */
+	char *buf;
+	size_t size;
+	/** Formatted bytes in buf. */
+	size_t used;
+	/** File offset of buf[0]. */
+	off_t offset;
+	bool is_direct;
+	/** -1 after a failed write, errno tells why. */
+	int rc;
+};
+
+/**
+ * Create or truncate the file. @a flags are num_writer_flags.
+ * Returns -1 if the file can not be opened.
+ */
+int
+num_writer_open(struct num_writer *w, const char *path, int flags);
+
+/** Write the numbers, each followed by a space. */
+void
+num_writer_put(struct num_writer *w, const int *numbers, size_t count);
+
+/** Write out the rest and close the file. Returns -1 on any error. */
+int
+num_writer_close(struct num_writer *w);
+
+/**
+ * Format the number and a space at @a p, return the end. At most
+ * NUM_MAX_LEN bytes are written.
+ */
+char *
+num_format(char *p, int value);
+
+enum {
+	/** Longest formatted number: "-2147483648 ". */
+	NUM_MAX_LEN = 12,
+};
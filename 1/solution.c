@@ -1,187 +1,1161 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "libcoro.h"
+#include "libcoro_io.h"
+#include "libcoro_sync.h"
 #include <time.h>
-#include "Vector.h"
+#include "../utils/vec.h"
+#include "sort.h"
+#include "num_writer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct Files{
     char **fileNames;
     int count;
-    int current;
 } files;
 
-double *total_time;
-int global_counter = 0;
-Vector *vectors;
-int global_counter_vector = 0;
+VEC_DECL(int_vec, int)
+
+/** A file to sort and its size in bytes, -1 if it is unknown. */
+struct InputFile {
+    char *name;
+    off_t size;
+};
+
+struct Sorter {
+    int id;
+    char name[16];
+};
+
+/** Profiles of the sorters, taken when they are done. */
+struct coro_profile *sorter_profiles;
+/** Input files are raw native int32, not text. */
+bool is_binary_input = false;
+/** Write result.txt with O_DIRECT, -d option. */
+bool is_direct_output = false;
+/** Some numbers are lost, result.txt is not written. Set by any thread. */
+bool is_failed = false;
+/** How the files are sorted, -s option. */
+enum sort_algo sort_algo = SORT_ALGO_AUTO;
+/**
+ * Memory for the numbers in bytes, 0 - unlimited. With a budget the
+ * files are sorted by parts into run files, which are then merged.
+ */
+size_t memory_budget = 0;
+/** Numbers in one part of a file sorted in memory, with a budget. */
+size_t chunk_size = 0;
+/**
+ * Run files the merger may keep open, by the file descriptor limit.
+ * When it has that many, some are merged into one. 0 - unlimited.
+ */
+int max_open_runs = 0;
+/** The smallest part of a file or a run to work with. */
+#define MIN_CHUNK_SIZE 1024
+/** Descriptors kept for stdio, the I/O engine, result.txt and such. */
+#define RESERVED_FDS 16
+/**
+ * Sorters per worker thread with an auto coroutine count: while one
+ * waits for its file to be read or its run to be written, the other
+ * keeps the CPU busy.
+ */
+#define AUTO_SORTERS_PER_WORKER 2
+
+/** A sorted part of the input: in memory or in a run file. */
+struct SortedRun {
+    /** The numbers, if they are in memory. */
+    struct int_vec *vector;
+    /** Otherwise the run file of raw int32 numbers. */
+    int fd;
+    size_t count;
+};
+
+/*
+ * The coroutines form a pipeline: the sorters take file names from
+ * file_channel and send the sorted numbers to sorted_channel, the
+ * merger collects them and merges them into result.txt. When the
+ * last sorter is done, the closer closes sorted_channel.
+ */
+struct coro_channel file_channel;
+struct coro_channel sorted_channel;
+struct coro_wait_group sorters;
 
 /**
  * You can compile and run this code using the commands:
  *
- * $> gcc solution.c libcoro.c
- * $> ./a.out
+ * $> gcc solution.c sort.c num_writer.c libcoro.c libcoro_io.c libcoro_sync.c -pthread
+ * $> ./a.out [-l target_latency_us] [-w threads] [-b] [-d] [-M budget_mb] [-s auto|merge|radix] [-p profile.json] coroutine_count|auto file1 file2 ...
+ *
+ * With -l each of N coroutines gets T / N microseconds of work
+ * before it yields, otherwise it yields after each sort pass.
+ * With -w the coroutines are run by that many threads, -w 0 means
+ * one per CPU.
+ * With -b the input files are raw int32 numbers in the host byte
+ * order, as written by generator.py -b.
+ * With -d result.txt is written with O_DIRECT, past the page cache.
+ * With -M the numbers take at most that many MiB of memory, not
+ * counting the I/O buffers. The files are sorted by parts which fit
+ * into the budget, the parts are stored in $TMPDIR (/tmp by
+ * default) and merged from there. When there are more parts than
+ * the budget or the open files limit allow to merge at once, they
+ * are merged in several passes.
+ * With -s the numbers are sorted by the merge sort or by the radix
+ * sort. By default the radix sort is taken when it is faster for
+ * the size and the range of the numbers.
+ * With -p the time profile of each coroutine is written to that
+ * file as JSON at exit: wall, run, CPU and waiting time and a
+ * histogram of the slice lengths.
+ *
+ * The files are handed out to the coroutines from the biggest one.
+ * With "auto" instead of the coroutine count there are 2 of them
+ * per thread, but not more than the files.
  */
 
-int min(int a, int b) {
-    return a < b ? a : b;
+/**
+ * Take the sorted numbers from the scratch buffer, if they ended up
+ * there. The buffer gets the old array of the vector instead.
+ */
+static void swap_with_scratch(struct int_vec *vector, int *sorted, struct sort_buf *scratch) {
+    if (sorted == vector->data) {
+        return;
+    }
+    int *old_data = vector->data;
+    size_t old_capacity = vector->capacity;
+    vector->data = scratch->data;
+    vector->capacity = scratch->capacity;
+    scratch->data = old_data;
+    scratch->capacity = old_capacity;
 }
 
-void merge(Vector *vector, int left, int mid, int right) {
-    int it1 = 0;
-    int it2 = 0;
+/** Size of one read request. Other coroutines run between them. */
+#define READ_CHUNK_SIZE (1024 * 1024)
+/** Text is parsed by slices of this size, with a yield between. */
+#define PARSE_SLICE_SIZE (1024 * 1024)
+
+static inline int is_digit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
 
-    Vector result;
-    init_vector(&result);
-    result.capacity = vector->capacity;
-    result.data = realloc(result.data, sizeof(int) * result.capacity);
+/** Bit i is set if p[i] is a digit, for the 16 bytes at p. */
+static inline unsigned digit_mask16(const char *p) {
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    /*
+     * c - '0' < 10 as unsigned. SSE2 compares only signed bytes,
+     * so both sides are shifted by 0x80.
+     */
+    __m128i d = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8('0')),
+                              _mm_set1_epi8((char)0x80));
+    return _mm_movemask_epi8(_mm_cmplt_epi8(d, _mm_set1_epi8((char)(10 ^ 0x80))));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 16; ++i) {
+        mask |= (unsigned)is_digit(p[i]) << i;
+    }
+    return mask;
+#endif
+}
 
-    while (left + it1 < mid && mid + it2 < right) {
-        if (vector->data[left + it1] < vector->data[mid + it2]) {
-            result.data[it1 + it2] = vector->data[left + it1];
-            it1 += 1;
+/**
+ * Value of len (1..8) digits at p. 8 bytes at p must be readable.
+ * All the digits are converted at once inside one 64 bit word.
+ */
+static inline uint32_t parse_digits8(const char *p, int len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t val;
+    memcpy(&val, p, 8);
+    /* The first digit is in the lowest byte. Pad it with zeros in front. */
+    val = (val << (8 * (8 - len))) & 0x0F0F0F0F0F0F0F0FULL;
+    val = (val * 10) + (val >> 8);
+    val = (((val & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+           (((val >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+    return (uint32_t)val;
+#else
+    uint32_t val = 0;
+    for (int i = 0; i < len; ++i) {
+        val = val * 10 + (p[i] - '0');
+    }
+    return val;
+#endif
+}
+
+/**
+ * Parse integers separated by any non-digit characters from
+ * [p, end) to *out, until it reaches out_end. Moves *out to the end
+ * of the parsed numbers, returns where the parsing stopped in the
+ * text. Digit runs are found 16 bytes at a time and converted
+ * without a loop over the digits, while at least 16 bytes are left;
+ * the tail is parsed byte by byte.
+ */
+static const char *parse_numbers(const char *p, const char *end, int **out, int *out_end) {
+    int *o = *out;
+    while (p < end && o < out_end) {
+        int sign = 1;
+        if (*p == '-' && p + 1 < end && is_digit(p[1])) {
+            sign = -1;
+            ++p;
+        }
+        if (!is_digit(*p)) {
+            ++p;
+            continue;
         }
-        else {
-            result.data[it1 + it2] = vector->data[mid + it2];
-            it2 += 1;
+        long long number = 0;
+        int len = end - p >= 16 ? __builtin_ctz(~digit_mask16(p)) : 16;
+        if (len <= 8) {
+            number = parse_digits8(p, len);
+            p += len;
+        } else if (len < 16) {
+            number = (long long)parse_digits8(p, len - 8) * 100000000 +
+                     parse_digits8(p + len - 8, 8);
+            p += len;
+        } else {
+            while (p < end && is_digit(*p)) {
+                number = number * 10 + (*p - '0');
+                ++p;
+            }
         }
+        *o++ = (int)(sign * number);
     }
+    *out = o;
+    return p;
+}
 
-    while (left + it1 < mid) {
-        result.data[it1 + it2] = vector->data[left + it1];
-        it1 += 1;
+/**
+ * Parse the whole file mapped into memory. The kernel reads it
+ * ahead while the beginning is parsed.
+ */
+static int read_text_mmap(int fd, size_t size, struct int_vec *vector) {
+    char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+        return -1;
+    }
+    madvise(text, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    /* At most one number per two bytes: a digit and a separator. */
+    int_vec_reserve(vector, size / 2 + 1);
+    const char *p = text;
+    const char *end = text + size;
+    int *out = vector->data;
+    int *out_end = vector->data + vector->capacity;
+    while (p < end) {
+        const char *slice_end = end - p > PARSE_SLICE_SIZE ? p + PARSE_SLICE_SIZE : end;
+        /* Do not cut a number in two, nor its sign off. */
+        while (slice_end < end && (is_digit(*slice_end) || slice_end[-1] == '-')) {
+            ++slice_end;
+        }
+        parse_numbers(p, slice_end, &out, out_end);
+        p = slice_end;
+        coro_yield_if_expired();
+    }
+    vector->size = out - vector->data;
+    munmap(text, size);
+    return 0;
+}
+
+/**
+ * Read the text by chunks, for the files which can not be mapped.
+ * A number split between two chunks is kept in 'number' until its
+ * end is read.
+ */
+static int read_text_chunked(int fd, struct int_vec *vector) {
+    char *buf = malloc(READ_CHUNK_SIZE);
+    long long number = 0;
+    int sign = 1;
+    int in_number = 0;
+    ssize_t size;
+    while ((size = coro_read(fd, buf, READ_CHUNK_SIZE, -1)) > 0) {
+        for (ssize_t i = 0; i < size; ++i) {
+            char c = buf[i];
+            if (c >= '0' && c <= '9') {
+                number = number * 10 + (c - '0');
+                in_number = 1;
+            } else {
+                if (in_number) {
+                    int_vec_push(vector, (int)(sign * number));
+                }
+                number = 0;
+                /* As in parse_numbers(), '-' starts a number even right after one. */
+                sign = c == '-' ? -1 : 1;
+                in_number = 0;
+            }
+        }
+    }
+    if (in_number) {
+        int_vec_push(vector, (int)(sign * number));
     }
+    free(buf);
+    return size < 0 ? -1 : 0;
+}
 
-    while (mid + it2 < right) {
-        result.data[it1 + it2] = vector->data[mid + it2];
-        it2 += 1;
+/**
+ * Read raw int32 numbers right into the vector. The reads are
+ * asynchronous, other coroutines run meanwhile. A file with a part
+ * of a number at the end is malformed, not read.
+ */
+static int read_binary(int fd, size_t size, struct int_vec *vector) {
+    if (size % sizeof(int) != 0) {
+        return -1;
+    }
+    size_t count = size / sizeof(int);
+    int_vec_reserve(vector, count);
+    char *dst = (char *)vector->data;
+    size_t total = count * sizeof(int);
+    size_t done = 0;
+    while (done < total) {
+        size_t chunk = total - done < READ_CHUNK_SIZE ? total - done : READ_CHUNK_SIZE;
+        ssize_t rc = coro_read(fd, dst + done, chunk, done);
+        if (rc <= 0) {
+            return -1;
+        }
+        done += rc;
     }
+    vector->size = count;
+    return 0;
+}
 
-    for (int i = 0; i < it1 + it2; ++i) {
-        vector->data[left + i] = result.data[i];
+/**
+ * Read the numbers of the file. Text files are mapped into memory
+ * and parsed in place, into a vector sized by the file size. Files
+ * which can not be mapped, like pipes, are read by chunks.
+ */
+int read_numbers(const char *fileName, struct int_vec *vector) {
+    int fd = coro_open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    int rc = fstat(fd, &st);
+    if (rc == 0) {
+        if (is_binary_input) {
+            rc = read_binary(fd, st.st_size, vector);
+        } else if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+                   read_text_mmap(fd, st.st_size, vector) != 0) {
+            rc = read_text_chunked(fd, vector);
+        }
     }
-    freeVector(&result);
+    coro_close(fd);
+    return rc;
 }
 
 /**
- * Coroutine body. This code is executed by all the coroutines. Here you
+ * Streaming reader of the numbers of a file, for the external sort.
+ * The file is read by parts, never as a whole.
+ */
+struct NumberReader {
+    int fd;
+    /** Text read but not parsed yet is [pos, end) of buf. */
+    char *buf;
+    char *pos;
+    char *end;
+    bool is_eof;
+    /** File offset of the next read. */
+    off_t offset;
+};
+
+static int reader_open(struct NumberReader *reader, const char *fileName) {
+    reader->fd = coro_open(fileName, O_RDONLY, 0);
+    if (reader->fd < 0) {
+        return -1;
+    }
+    reader->buf = is_binary_input ? NULL : malloc(READ_CHUNK_SIZE);
+    reader->pos = reader->buf;
+    reader->end = reader->buf;
+    reader->is_eof = false;
+    reader->offset = 0;
+    return 0;
+}
+
+static void reader_close(struct NumberReader *reader) {
+    free(reader->buf);
+    coro_close(reader->fd);
+}
+
+/**
+ * Read up to max numbers to out. Returns how many are read, 0 at
+ * the end of the file, -1 on an error.
+ */
+static ssize_t reader_next(struct NumberReader *reader, int *out, size_t max) {
+    if (is_binary_input) {
+        size_t size = max * sizeof(int);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t rc = coro_read(reader->fd, (char *)out + done, size - done,
+                                   reader->offset + done);
+            if (rc < 0) {
+                return -1;
+            }
+            if (rc == 0) {
+                break;
+            }
+            done += rc;
+        }
+        if (done % sizeof(int) != 0) {
+            /* A part of a number at the end of the file. */
+            return -1;
+        }
+        reader->offset += done;
+        return done / sizeof(int);
+    }
+    int *o = out;
+    int *out_end = out + max;
+    while (o < out_end) {
+        /* Parse only the complete numbers, until the file is over. */
+        const char *limit = reader->end;
+        if (!reader->is_eof) {
+            while (limit > reader->pos && (is_digit(limit[-1]) || limit[-1] == '-')) {
+                --limit;
+            }
+        }
+        reader->pos = (char *)parse_numbers(reader->pos, limit, &o, out_end);
+        if (o == out_end || reader->is_eof) {
+            break;
+        }
+        /* Keep the unparsed tail, read more after it. */
+        size_t tail = reader->end - reader->pos;
+        if (tail == READ_CHUNK_SIZE) {
+            /* A number longer than the buffer. */
+            return -1;
+        }
+        memmove(reader->buf, reader->pos, tail);
+        reader->pos = reader->buf;
+        reader->end = reader->buf + tail;
+        ssize_t rc = coro_read(reader->fd, reader->end, READ_CHUNK_SIZE - tail,
+                               reader->offset);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            reader->is_eof = true;
+        }
+        reader->offset += rc;
+        reader->end += rc;
+    }
+    return o - out;
+}
+
+/** Lose the numbers: result.txt will not be written. */
+static void set_failed(void) {
+    __atomic_store_n(&is_failed, true, __ATOMIC_RELAXED);
+}
+
+static bool get_failed(void) {
+    return __atomic_load_n(&is_failed, __ATOMIC_RELAXED);
+}
+
+/** Create a run file. It has no name, it is gone once closed. */
+static int run_file_create(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL) {
+        dir = "/tmp";
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sort_run_XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/** Write count numbers to the run file at the offset, in numbers. */
+static int run_file_write(int fd, const int *numbers, size_t count, size_t offset) {
+    size_t size = count * sizeof(int);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = coro_write(fd, (const char *)numbers + done, size - done,
+                                offset * sizeof(int) + done);
+        if (rc <= 0) {
+            return -1;
+        }
+        done += rc;
+    }
+    return 0;
+}
+
+static struct SortedRun *run_file_new(int fd, size_t count) {
+    struct SortedRun *run = malloc(sizeof(struct SortedRun));
+    run->vector = NULL;
+    run->fd = fd;
+    run->count = count;
+    return run;
+}
+
+/** Store the sorted numbers in a run file. */
+static struct SortedRun *write_run(const int *numbers, size_t count) {
+    int fd = run_file_create();
+    if (fd < 0) {
+        return NULL;
+    }
+    if (run_file_write(fd, numbers, count, 0) != 0) {
+        close(fd);
+        return NULL;
+    }
+    return run_file_new(fd, count);
+}
+
+/** Sort the whole file in memory. */
+static void sort_file(const char *fileName, struct sort_buf *scratch) {
+    struct int_vec *vector = malloc(sizeof(struct int_vec));
+    int_vec_create(vector);
+    if (read_numbers(fileName, vector) != 0) {
+        printf("Can not read %s\n", fileName);
+        set_failed();
+        int_vec_destroy(vector);
+        free(vector);
+        return;
+    }
+    int *sorted = sort_numbers(vector->data, vector->size, scratch, sort_algo);
+    swap_with_scratch(vector, sorted, scratch);
+    /*
+     * The text was sized by the worst case of one number per two
+     * bytes, do not hold that till the merge.
+     */
+    int_vec_shrink(vector);
+
+    struct SortedRun *run = malloc(sizeof(struct SortedRun));
+    run->vector = vector;
+    run->fd = -1;
+    run->count = vector->size;
+    coro_channel_put(&sorted_channel, run);
+}
+
+/**
+ * Sort the file by parts of chunk_size numbers, each part goes to a
+ * run file. While one coroutine waits for its run to be written or
+ * for the next part to be read, the others sort theirs.
+ */
+static void sort_file_external(const char *fileName, int *chunk, struct sort_buf *scratch) {
+    struct NumberReader reader;
+    if (reader_open(&reader, fileName) != 0) {
+        printf("Can not read %s\n", fileName);
+        set_failed();
+        return;
+    }
+    ssize_t count;
+    while ((count = reader_next(&reader, chunk, chunk_size)) > 0) {
+        int *sorted = sort_numbers(chunk, count, scratch, sort_algo);
+        struct SortedRun *run = write_run(sorted, count);
+        if (run == NULL) {
+            printf("Can not write a run of %s\n", fileName);
+            set_failed();
+            break;
+        }
+        coro_channel_put(&sorted_channel, run);
+    }
+    if (count < 0) {
+        printf("Can not read %s\n", fileName);
+        set_failed();
+    }
+    reader_close(&reader);
+}
+
+/**
+ * Coroutine body. This code is executed by all the sorters. Here you
  * implement your solution, sort each individual file.
  */
 static int
 coroutine_func_f(void *context)
 {
-    char *name = context;
-    printf("Started coroutine %s\n", name);
-    free(name);
+    struct Sorter *sorter = context;
+    coro_set_name(sorter->name);
+    printf("Started coroutine %s\n", sorter->name);
+
+    /* One scratch buffer for all the files of this coroutine. */
+    struct sort_buf scratch;
+    sort_buf_create(&scratch);
+    int *chunk = NULL;
+    if (memory_budget != 0) {
+        chunk = malloc(chunk_size * sizeof(int));
+        sort_buf_reserve(&scratch, chunk_size);
+    }
+    void *data;
+    while (coro_channel_get(&file_channel, &data) == 0) {
+        char *fileName = data;
+        if (memory_budget != 0) {
+            sort_file_external(fileName, chunk, &scratch);
+        } else {
+            sort_file(fileName, &scratch);
+        }
+        printf("Coroutine #%d switch count: %lld\n", sorter->id, coro_switch_count(coro_this()));
+    }
+    free(chunk);
+    sort_buf_destroy(&scratch);
+    coro_get_profile(coro_this(), &sorter_profiles[sorter->id]);
+    coro_wait_group_done(&sorters);
+	/* This will be returned from coro_status(). */
+	return 0;
+}
+
+/** A part of a run file read into memory. */
+struct RunBuffer {
+    int *data;
+    size_t count;
+};
+
+/**
+ * Reads a run file ahead into one buffer, while the merger takes
+ * the numbers from the other one.
+ */
+struct RunReader {
+    struct SortedRun *run;
+    /** Bytes of the file read so far. */
+    size_t offset;
+    /** Capacity of each buffer, in numbers. */
+    size_t buf_size;
+    struct RunBuffer bufs[2];
+    /** The buffer the merger takes the numbers from. */
+    struct RunBuffer *current;
+    /** Buffers to read into. */
+    struct coro_channel free_bufs;
+    /** Buffers read, in the file order. */
+    struct coro_channel full_bufs;
+    struct coro_wait_group *done;
+};
+
+static int
+run_reader_f(void *context)
+{
+    struct RunReader *reader = context;
+    coro_set_name("run_reader");
+    size_t total = reader->run->count * sizeof(int);
+    void *data;
+    while (reader->offset < total &&
+           coro_channel_get(&reader->free_bufs, &data) == 0) {
+        struct RunBuffer *buf = data;
+        size_t size = total - reader->offset;
+        if (size > reader->buf_size * sizeof(int)) {
+            size = reader->buf_size * sizeof(int);
+        }
+        size_t done = 0;
+        while (done < size) {
+            ssize_t rc = coro_read(reader->run->fd, (char *)buf->data + done,
+                                   size - done, reader->offset + done);
+            if (rc <= 0) {
+                break;
+            }
+            done += rc;
+        }
+        if (done < size) {
+            printf("Can not read a run\n");
+            break;
+        }
+        buf->count = size / sizeof(int);
+        reader->offset += size;
+        coro_channel_put(&reader->full_bufs, buf);
+    }
+    coro_channel_close(&reader->full_bufs);
+    coro_wait_group_done(reader->done);
+    return 0;
+}
+
+/** Give the merger the next buffer of a run file. */
+static void run_refill(struct sort_run *run) {
+    struct RunReader *reader = run->ctx;
+    if (reader->current != NULL) {
+        coro_channel_put(&reader->free_bufs, reader->current);
+        reader->current = NULL;
+    }
+    void *data;
+    if (coro_channel_get(&reader->full_bufs, &data) != 0) {
+        return;
+    }
+    reader->current = data;
+    run->pos = reader->current->data;
+    run->end = reader->current->data + reader->current->count;
+}
+
+/** Numbers taken from the k-way merge at once. */
+#define MERGE_CHUNK_SIZE 4096
+/** Numbers written to a run file at once by a merge pass. */
+#define RUN_WRITE_SIZE (64 * 1024)
 
-    clock_t tic = clock();
+/** The runs being merged and the readers of the run files among them. */
+struct RunMerge {
+    struct SortedRun **sorted;
+    int count;
+    struct sort_run *runs;
+    struct RunReader *readers;
+    struct coro_wait_group readers_done;
+    struct sort_merger merger;
+};
+
+/** Runs which can be merged at once with that much memory, at least 2. */
+static int merge_fan_in(size_t budget) {
+    size_t fan_in = budget / (2 * sizeof(int) * MIN_CHUNK_SIZE);
+    if (fan_in < 2) {
+        return 2;
+    }
+    return fan_in > INT_MAX ? INT_MAX : (int)fan_in;
+}
 
-    int my_counter = global_counter++;
-    while(files.current < files.count) {
-        char *fileName = files.fileNames[files.current];
-        files.current++;
+/**
+ * Start merging the runs. Run files are read ahead by a coroutine
+ * each, the read buffers share the budget.
+ */
+static void run_merge_create(struct RunMerge *m, struct SortedRun **sorted, int count,
+                             size_t budget) {
+    int file_run_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (sorted[i]->vector == NULL) {
+            ++file_run_count;
+        }
+    }
+    size_t buf_size = MIN_CHUNK_SIZE;
+    if (file_run_count > 0 && budget / (2 * sizeof(int) * file_run_count) > buf_size) {
+        buf_size = budget / (2 * sizeof(int) * file_run_count);
+    }
+    m->sorted = sorted;
+    m->count = count;
+    coro_wait_group_create(&m->readers_done);
+    m->runs = calloc(count, sizeof(struct sort_run));
+    m->readers = calloc(count, sizeof(struct RunReader));
+    for (int i = 0; i < count; ++i) {
+        if (sorted[i]->vector != NULL) {
+            m->runs[i].pos = sorted[i]->vector->data;
+            m->runs[i].end = sorted[i]->vector->data + sorted[i]->vector->size;
+            continue;
+        }
+        struct RunReader *reader = &m->readers[i];
+        reader->run = sorted[i];
+        reader->buf_size = buf_size;
+        reader->done = &m->readers_done;
+        coro_channel_create(&reader->free_bufs, 2);
+        coro_channel_create(&reader->full_bufs, 2);
+        for (int j = 0; j < 2; ++j) {
+            reader->bufs[j].data = malloc(buf_size * sizeof(int));
+            coro_channel_put(&reader->free_bufs, &reader->bufs[j]);
+        }
+        m->runs[i].refill = run_refill;
+        m->runs[i].ctx = reader;
+        coro_wait_group_add(&m->readers_done, 1);
+        coro_new(run_reader_f, reader);
+    }
+    sort_merger_create(&m->merger, m->runs, count);
+}
 
-        FILE *myFile = fopen(fileName, "r");
-        Vector vector;
-        init_vector(&vector);
+/**
+ * Free the runs. A merge stopped half way lets its readers go by
+ * closing their free buffer channels.
+ */
+static void run_merge_destroy(struct RunMerge *m) {
+    sort_merger_destroy(&m->merger);
+    for (int i = 0; i < m->count; ++i) {
+        if (m->sorted[i]->vector == NULL) {
+            coro_channel_close(&m->readers[i].free_bufs);
+        }
+    }
+    coro_wait_group_wait(&m->readers_done);
+    for (int i = 0; i < m->count; ++i) {
+        struct SortedRun *run = m->sorted[i];
+        if (run->vector != NULL) {
+            int_vec_destroy(run->vector);
+            free(run->vector);
+        } else {
+            free(m->readers[i].bufs[0].data);
+            free(m->readers[i].bufs[1].data);
+            coro_channel_destroy(&m->readers[i].free_bufs);
+            coro_channel_destroy(&m->readers[i].full_bufs);
+            close(run->fd);
+        }
+        free(run);
+    }
+    free(m->readers);
+    free(m->runs);
+}
 
-        int temp;
-        while (fscanf(myFile, "%d", &temp) != EOF) {
-            push_back(&vector, temp);
+/** Merge the runs into a new run file. NULL if it can not be written. */
+static struct SortedRun *merge_to_run(struct SortedRun **sorted, int count, size_t budget) {
+    struct RunMerge merge;
+    run_merge_create(&merge, sorted, count, budget);
+    int fd = run_file_create();
+    int *chunk = malloc(RUN_WRITE_SIZE * sizeof(int));
+    size_t total = 0;
+    size_t size;
+    while (fd >= 0 && (size = sort_merger_next(&merge.merger, chunk, RUN_WRITE_SIZE)) > 0) {
+        if (run_file_write(fd, chunk, size, total) != 0) {
+            close(fd);
+            fd = -1;
+            break;
         }
-        fclose(myFile);
+        total += size;
+        coro_yield_if_expired();
+    }
+    free(chunk);
+    run_merge_destroy(&merge);
+    return fd < 0 ? NULL : run_file_new(fd, total);
+}
+
+static int compare_runs_by_count(const void *a, const void *b) {
+    const struct SortedRun *ra = *(struct SortedRun *const *)a;
+    const struct SortedRun *rb = *(struct SortedRun *const *)b;
+    if (ra->count != rb->count) {
+        return ra->count < rb->count ? -1 : 1;
+    }
+    return 0;
+}
 
-        for (int i = 1; i < vector.size; i *= 2) {
-            for (int j = 0; j < vector.size - i; j += 2 * i) {
-                merge(&vector, j, j + i, min(j + 2 * i, vector.size));
+/**
+ * Merge the merge_count smallest of the runs into one. Merging the
+ * smallest ones first, each number is rewritten about log(runs)
+ * times, not once per pass as when the biggest run is remerged.
+ */
+static void merge_smallest(struct SortedRun **sorted, int *count, int merge_count,
+                           size_t budget) {
+    qsort(sorted, *count, sizeof(struct SortedRun *), compare_runs_by_count);
+    struct SortedRun *run = merge_to_run(sorted, merge_count, budget);
+    int kept = *count - merge_count;
+    memmove(sorted + 1, sorted + merge_count, kept * sizeof(struct SortedRun *));
+    if (run != NULL) {
+        sorted[0] = run;
+        *count = kept + 1;
+    } else {
+        printf("Can not write a merged run\n");
+        set_failed();
+        memmove(sorted, sorted + 1, kept * sizeof(struct SortedRun *));
+        *count = kept;
+    }
+}
+
+/**
+ * Collect the sorted runs and merge them, streaming the result to
+ * result.txt. The numbers are written while they are merged, the
+ * merged array is never built in memory.
+ *
+ * With a budget the runs are files. When the merger holds
+ * max_open_runs of them, the smallest are merged into one while the
+ * sorters go on, within a sorter's share of the budget. When all
+ * are sorted, the runs are merged in passes of as many as the whole
+ * budget allows, the last pass writes result.txt.
+ */
+static int
+merger_func_f(void *context)
+{
+    (void)context;
+    coro_set_name("merger");
+    struct SortedRun **sorted = NULL;
+    int sorted_count = 0;
+    int sorted_capacity = 0;
+    void *data;
+    while (coro_channel_get(&sorted_channel, &data) == 0) {
+        if (sorted_count == sorted_capacity) {
+            sorted_capacity = sorted_capacity == 0 ? 16 : sorted_capacity * 2;
+            sorted = realloc(sorted, sorted_capacity * sizeof(struct SortedRun *));
+        }
+        sorted[sorted_count++] = data;
+        if (sorted_count == max_open_runs) {
+            size_t share = 2 * sizeof(int) * chunk_size;
+            /* Merge only a half, or the biggest run is rewritten each time. */
+            int fan_in = merge_fan_in(share);
+            if (fan_in > max_open_runs / 2) {
+                fan_in = max_open_runs / 2 > 2 ? max_open_runs / 2 : 2;
             }
-            clock_t toc = clock();
-            total_time[my_counter] += (double)(toc - tic) / CLOCKS_PER_SEC;
-            coro_yield();
-            tic = clock();
+            merge_smallest(sorted, &sorted_count, fan_in, share);
         }
-        printf("Coroutine #%d switch count: %lld\n", my_counter, coro_switch_count(coro_this()));
+    }
+    if (memory_budget != 0) {
+        int fan_in = merge_fan_in(memory_budget);
+        while (sorted_count > fan_in && !get_failed()) {
+            /*
+             * The first pass takes the runs left over from the full
+             * ones, so that the last one has fan_in runs.
+             */
+            merge_smallest(sorted, &sorted_count, (sorted_count - 2) % (fan_in - 1) + 2,
+                           memory_budget);
+        }
+    }
 
-        init_vector(&vectors[global_counter_vector]);
-        for (int i = 0; i < vector.size; ++i) {
-            push_back(&vectors[global_counter_vector], vector.data[i]);
+    struct RunMerge merge;
+    run_merge_create(&merge, sorted, sorted_count, memory_budget);
+    struct num_writer writer;
+    if (get_failed()) {
+        printf("Some numbers are lost, result.txt is not written\n");
+    } else if (num_writer_open(&writer, "result.txt", is_direct_output ? NUM_WRITER_DIRECT : 0) == 0) {
+        int chunk[MERGE_CHUNK_SIZE];
+        size_t count;
+        while ((count = sort_merger_next(&merge.merger, chunk, MERGE_CHUNK_SIZE)) > 0) {
+            num_writer_put(&writer, chunk, count);
+            coro_yield_if_expired();
+        }
+        if (num_writer_close(&writer) != 0) {
+            printf("Can not write result.txt\n");
+            set_failed();
         }
-        global_counter_vector++;
-        freeVector(&vector);
+    } else {
+        printf("Can not open result.txt\n");
+        set_failed();
+    }
+    run_merge_destroy(&merge);
+    free(sorted);
+    return 0;
+}
+
+/** Tell the merger there will be no more files. */
+static int
+closer_func_f(void *context)
+{
+    (void)context;
+    coro_set_name("closer");
+    coro_wait_group_wait(&sorters);
+    coro_channel_close(&sorted_channel);
+    return 0;
+}
 
+/** The biggest files go first. */
+static int compare_input_files(const void *a, const void *b) {
+    const struct InputFile *fa = a;
+    const struct InputFile *fb = b;
+    if (fa->size != fb->size) {
+        return fa->size > fb->size ? -1 : 1;
     }
-	/* This will be returned from coro_status(). */
-	return 0;
+    return 0;
+}
+
+/**
+ * Order the files for the sorters. They take the next file when done
+ * with the previous one, so handing out the biggest files first
+ * leaves only small ones for the end, and the sorters finish at about
+ * the same time instead of waiting for one straggler.
+ */
+static void order_files_by_size(char **names, int count) {
+    struct InputFile *input = malloc(count * sizeof(struct InputFile));
+    for (int i = 0; i < count; ++i) {
+        struct stat st;
+        input[i].name = names[i];
+        input[i].size = stat(names[i], &st) == 0 ? st.st_size : -1;
+    }
+    qsort(input, count, sizeof(struct InputFile), compare_input_files);
+    for (int i = 0; i < count; ++i) {
+        names[i] = input[i].name;
+    }
+    free(input);
+}
+
+/**
+ * Number of sorters for "auto": enough to keep all the workers busy
+ * while some of the sorters wait for I/O, but not more than the
+ * files - one file is sorted by one coroutine, the extra ones would
+ * only take memory.
+ */
+static int auto_coroutine_count(int file_count, int worker_count) {
+    int count = worker_count * AUTO_SORTERS_PER_WORKER;
+    if (count > file_count) {
+        count = file_count;
+    }
+    return count > 0 ? count : 1;
+}
+
+static void print_usage(const char *name) {
+    printf("Usage: %s [-l target_latency_us] [-w threads] [-b] [-d] [-M budget_mb] [-s auto|merge|radix] [-p profile.json] coroutine_count|auto files...\n", name);
+}
+
+/** A whole decimal number in [min, max], nothing else in arg. */
+static int parse_number(const char *arg, long long min, long long max, long long *value) {
+    char *end;
+    errno = 0;
+    long long number = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0 || number < min || number > max) {
+        return -1;
+    }
+    *value = number;
+    return 0;
+}
+
+/** Coroutine count argument: "auto" gives 0, otherwise a positive number. */
+static int parse_coroutine_count(const char *arg, int *count) {
+    if (strcmp(arg, "auto") == 0) {
+        *count = 0;
+        return 0;
+    }
+    long long value;
+    if (parse_number(arg, 1, INT_MAX, &value) != 0) {
+        return -1;
+    }
+    *count = (int)value;
+    return 0;
+}
+
+/**
+ * Run files the merger may hold within the open files limit. Each
+ * sorter takes up to three: its file, the run it writes and the one
+ * waiting in sorted_channel.
+ */
+static int max_runs_by_fd_limit(int sorter_count) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return 0;
+    }
+    rlim_t fds = limit.rlim_cur;
+    if (fds > INT_MAX) {
+        fds = INT_MAX;
+    }
+    long long runs = (long long)fds - RESERVED_FDS - 3LL * sorter_count;
+    return runs > 0 ? (int)runs : 0;
 }
 
 int
 main(int argc, char **argv)
 {
-    int count_coroutines = atoi(argv[1]);
+    long long target_latency = 0;
+    int worker_count = 1;
+    const char *profile_path = NULL;
+    long long value;
+    int opt;
+    while ((opt = getopt(argc, argv, "+l:w:bdM:s:p:")) != -1) {
+        switch (opt) {
+            case 'l':
+                /* Nanoseconds must fit too. */
+                if (parse_number(optarg, 0, LLONG_MAX / 1000, &target_latency) != 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                if (parse_number(optarg, 0, INT_MAX, &value) != 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                worker_count = (int)value;
+                if (worker_count == 0) {
+                    worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'b':
+                is_binary_input = true;
+                break;
+            case 'd':
+                is_direct_output = true;
+                break;
+            case 'M':
+                if (parse_number(optarg, 1, (long long)(SIZE_MAX / 2 / (1024 * 1024)),
+                                 &value) != 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                memory_budget = (size_t)value * 1024 * 1024;
+                break;
+            case 'p':
+                if (*optarg == '\0') {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                profile_path = optarg;
+                break;
+            case 's':
+                if (sort_algo_parse(optarg, &sort_algo) != 0) {
+                    printf("Unknown sort %s, expected auto, merge or radix\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+    int count_coroutines;
+    if (optind >= argc || parse_coroutine_count(argv[optind], &count_coroutines) != 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    ++optind;
+    if (count_coroutines == 0) {
+        count_coroutines = auto_coroutine_count(argc - optind, worker_count);
+        printf("Using %d coroutines\n", count_coroutines);
+    }
+    if (memory_budget != 0 && count_coroutines > 0) {
+        /*
+         * Each sorter has a part of a file and a scratch buffer. The
+         * merger gets the same share for merging runs meanwhile.
+         */
+        chunk_size = memory_budget / (2 * sizeof(int) * (count_coroutines + 1));
+        if (chunk_size < MIN_CHUNK_SIZE) {
+            chunk_size = MIN_CHUNK_SIZE;
+        }
+        max_open_runs = max_runs_by_fd_limit(count_coroutines);
+        if (max_open_runs < 2) {
+            printf("Too few open files allowed for %d coroutines\n", count_coroutines);
+            return -1;
+        }
+    }
 
-    clock_t tic = clock();
+    struct timespec tic;
+    clock_gettime(CLOCK_MONOTONIC, &tic);
+    clock_t cpu_tic = clock();
 
-    files.current = 0;
-    files.count = argc - 2;
+    files.count = argc - optind;
     files.fileNames = calloc(files.count, sizeof(char*));
 
-    total_time = calloc(count_coroutines, sizeof(double));
-    vectors = calloc(files.count, sizeof(Vector));
+    sorter_profiles = calloc(count_coroutines, sizeof(struct coro_profile));
+    struct Sorter *sorter_args = calloc(count_coroutines, sizeof(struct Sorter));
+
+    coro_channel_create(&file_channel, 0);
+    /*
+     * Run files hold descriptors, so with a budget the sorters wait
+     * while the merger is behind, instead of piling them up.
+     */
+    coro_channel_create(&sorted_channel, memory_budget != 0 ? count_coroutines : 0);
+    coro_wait_group_create(&sorters);
 
-    int k = 0;
-    for(int i = 2; i < argc; ++i) {
-        files.fileNames[k] = argv[i];
-        ++k;
+    for(int i = 0; i < files.count; ++i) {
+        files.fileNames[i] = argv[optind + i];
     }
+    order_files_by_size(files.fileNames, files.count);
+    for(int i = 0; i < files.count; ++i) {
+        coro_channel_put(&file_channel, files.fileNames[i]);
+    }
+    coro_channel_close(&file_channel);
 
-	coro_sched_init();
+	struct coro_sched_cfg cfg = {0};
+	/* T / N microseconds per coroutine, 0 means yield on each pass. */
+	if (count_coroutines > 0)
+		cfg.time_slice = target_latency * 1000 / count_coroutines;
+	cfg.worker_count = worker_count;
+	cfg.profile_path = profile_path;
+	coro_sched_init(&cfg);
+	coro_wait_group_add(&sorters, count_coroutines);
 	for (int i = 0; i < count_coroutines; ++i) {
-		char name[16];
-		sprintf(name, "coro_%d", i);
-		coro_new(coroutine_func_f, strdup(name));
+		sorter_args[i].id = i;
+		sprintf(sorter_args[i].name, "coro_%d", i);
+		coro_new(coroutine_func_f, &sorter_args[i]);
 	}
+	coro_new(merger_func_f, NULL);
+	coro_new(closer_func_f, NULL);
 	struct coro *c;
 	while ((c = coro_sched_wait()) != NULL) {
 		printf("Finished %d\n", coro_status(c));
 		coro_delete(c);
 	}
+	coro_io_destroy();
+	coro_sched_destroy();
 
-    Vector vector;
-    init_vector(&vector);
-
-    for(int i = 0; i < vectors[0].size; ++i) {
-        push_back(&vector, vectors[0].data[i]);
-    }
-    freeVector(&vectors[0]);
-
-    for(int i = 1; i < files.count; ++i) {
-        int last_sz = vector.size;
-
-        for(int j = 0; j < vectors[i].size; ++j) {
-            push_back(&vector, vectors[i].data[j]);
-        }
-        freeVector(&vectors[i]);
-
-        merge(&vector, 0, last_sz, vector.size);
-    }
+    coro_channel_destroy(&file_channel);
+    coro_channel_destroy(&sorted_channel);
 
-    FILE *writeFile = fopen("result.txt", "w");
-    for (int i = 0; i < vector.size; ++i) {
-        fprintf(writeFile, "%d ", vector.data[i]);
-    }
-
-    fclose(writeFile);
-    freeVector(&vector);
-    free(vectors);
-
-    for(int i = 0; i < global_counter; ++i) {
-        printf("Coroutine #%d time is %f microseconds\n", global_counter - i - 1, total_time[i] * 1000000);
+    for(int i = 0; i < count_coroutines; ++i) {
+        struct coro_profile *p = &sorter_profiles[i];
+        printf("Coroutine #%d time is %f microseconds: wall %f, waited %f\n", i,
+               p->run_time / 1000.0, p->wall_time / 1000.0, p->wait_time / 1000.0);
     }
+    free(sorter_args);
     free(files.fileNames);
 
-    free(total_time);
-    clock_t toc = clock();
-    printf("Elapsed: %f microseconds\n", (double)(toc - tic) / CLOCKS_PER_SEC * 1000000);
+    free(sorter_profiles);
+    struct timespec toc;
+    clock_gettime(CLOCK_MONOTONIC, &toc);
+    clock_t cpu_toc = clock();
+    printf("Elapsed: %f microseconds, CPU: %f microseconds\n",
+           (toc.tv_sec - tic.tv_sec) * 1000000.0 + (toc.tv_nsec - tic.tv_nsec) / 1000.0,
+           (double)(cpu_toc - cpu_tic) / CLOCKS_PER_SEC * 1000000);
 
-    return 0;
+    return is_failed ? -1 : 0;
 }
@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include "libcoro.h"
+#include "sort.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SORT_USE_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+/*
+ * The vector code is compiled for its instruction set regardless
+ * of the compiler flags, and is run only if the CPU has it.
+ */
+#define SORT_SSE4 __attribute__((target("sse4.1")))
+#define SORT_AVX2 __attribute__((target("avx2")))
+#else
+#define SORT_USE_X86 0
+#endif
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+typedef void
+(*sort_merge_two_f)(const int *a, size_t a_count, const int *b,
+		    size_t b_count, int *out);
+
+/** Best instruction set of the CPU, -1 until detected. */
+static int sort_isa_best = -1;
+static int sort_isa_current = -1;
+
+void
+sort_buf_create(struct sort_buf *buf)
+{
+	buf->data = NULL;
+	buf->capacity = 0;
+	buf->hist = NULL;
+}
+
+void
+sort_buf_destroy(struct sort_buf *buf)
+{
+	free(buf->data);
+	free(buf->hist);
+}
+
+void
+sort_buf_reserve(struct sort_buf *buf, size_t count)
+{
+	if (buf->capacity >= count)
+		return;
+	/* The old content is not needed, no point in realloc. */
+	free(buf->data);
+	buf->data = malloc(count * sizeof(int));
+	if (buf->data == NULL)
+		handle_error();
+	buf->capacity = count;
+}
+
+void
+sort_merge_two(const int *a, size_t a_count, const int *b, size_t b_count,
+	       int *out)
+{
+	const int *a_end = a + a_count;
+	const int *b_end = b + b_count;
+	while (a < a_end && b < b_end) {
+		if (*b < *a)
+			*out++ = *b++;
+		else
+			*out++ = *a++;
+	}
+	memcpy(out, a, (a_end - a) * sizeof(int));
+	out += a_end - a;
+	memcpy(out, b, (b_end - b) * sizeof(int));
+}
+
+static void
+sort_insertion(int *data, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		int value = data[i];
+		size_t j = i;
+		for (; j > 0 && data[j - 1] > value; --j)
+			data[j] = data[j - 1];
+		data[j] = value;
+	}
+}
+
+/**
+ * Merge tail of the vector kernels: @a kept numbers left in the
+ * registers, and the rest of the arrays, one of which is shorter
+ * than a vector.
+ */
+static void
+sort_merge_tail(const int *kept, size_t kept_count, const int *a,
+		size_t a_count, const int *b, size_t b_count, int *out)
+{
+	int buf[32];
+	if (a_count > b_count) {
+		const int *t = a;
+		a = b;
+		b = t;
+		size_t c = a_count;
+		a_count = b_count;
+		b_count = c;
+	}
+	sort_merge_two(kept, kept_count, a, a_count, buf);
+	sort_merge_two(buf, kept_count + a_count, b, b_count, out);
+}
+
+#if SORT_USE_X86
+
+static inline SORT_SSE4 void
+sse4_minmax(__m128i *a, __m128i *b)
+{
+	__m128i min = _mm_min_epi32(*a, *b);
+	*b = _mm_max_epi32(*a, *b);
+	*a = min;
+}
+
+/** Sort a bitonic vector. */
+static inline SORT_SSE4 __m128i
+sse4_clean(__m128i v)
+{
+	__m128i t = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm_blend_epi16(_mm_min_epi32(v, t), _mm_max_epi32(v, t), 0xF0);
+	t = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_blend_epi16(_mm_min_epi32(v, t), _mm_max_epi32(v, t), 0xCC);
+}
+
+/**
+ * Merge sorted v[0, n) and v[n, 2n) into sorted v[0, 2n). The
+ * second half is reversed, which makes the whole bitonic, and
+ * then it goes through a bitonic merge network.
+ */
+static inline SORT_SSE4 void
+sse4_merge_vecs(__m128i *v, int n)
+{
+	for (int i = 0; i < n / 2; ++i) {
+		__m128i t = v[n + i];
+		v[n + i] = v[2 * n - 1 - i];
+		v[2 * n - 1 - i] = t;
+	}
+	for (int i = n; i < 2 * n; ++i)
+		v[i] = _mm_shuffle_epi32(v[i], _MM_SHUFFLE(0, 1, 2, 3));
+	for (int d = n; d >= 1; d /= 2) {
+		for (int i = 0; i < 2 * n; i += 2 * d) {
+			for (int j = i; j < i + d; ++j)
+				sse4_minmax(&v[j], &v[j + d]);
+		}
+	}
+	for (int i = 0; i < 2 * n; ++i)
+		v[i] = sse4_clean(v[i]);
+}
+
+/** Sort 16 numbers in registers. */
+static SORT_SSE4 void
+sse4_sort16(int *data)
+{
+	__m128i v[4];
+	for (int i = 0; i < 4; ++i)
+		v[i] = _mm_loadu_si128((__m128i *)data + i);
+	/* Sort the columns with a network. */
+	sse4_minmax(&v[0], &v[1]);
+	sse4_minmax(&v[2], &v[3]);
+	sse4_minmax(&v[0], &v[2]);
+	sse4_minmax(&v[1], &v[3]);
+	sse4_minmax(&v[1], &v[2]);
+	/* Make the sorted columns rows. */
+	__m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+	__m128i t1 = _mm_unpackhi_epi32(v[0], v[1]);
+	__m128i t2 = _mm_unpacklo_epi32(v[2], v[3]);
+	__m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+	v[0] = _mm_unpacklo_epi64(t0, t2);
+	v[1] = _mm_unpackhi_epi64(t0, t2);
+	v[2] = _mm_unpacklo_epi64(t1, t3);
+	v[3] = _mm_unpackhi_epi64(t1, t3);
+	sse4_merge_vecs(&v[0], 1);
+	sse4_merge_vecs(&v[2], 1);
+	sse4_merge_vecs(v, 2);
+	for (int i = 0; i < 4; ++i)
+		_mm_storeu_si128((__m128i *)data + i, v[i]);
+}
+
+/**
+ * Merge two sorted arrays 4 numbers at a time. The next 4 are
+ * taken from the array with the smaller head and merged with the
+ * 4 biggest of the previous step.
+ */
+static SORT_SSE4 void
+sse4_merge_two(const int *a, size_t a_count, const int *b, size_t b_count,
+	       int *out)
+{
+	if (a_count < 4 || b_count < 4) {
+		sort_merge_two(a, a_count, b, b_count, out);
+		return;
+	}
+	const int *a_end = a + a_count;
+	const int *b_end = b + b_count;
+	__m128i v[2];
+	v[0] = _mm_loadu_si128((const __m128i *)a);
+	v[1] = _mm_loadu_si128((const __m128i *)b);
+	a += 4;
+	b += 4;
+	sse4_merge_vecs(v, 1);
+	_mm_storeu_si128((__m128i *)out, v[0]);
+	out += 4;
+	while (a_end - a >= 4 && b_end - b >= 4) {
+		if (*a < *b) {
+			v[0] = _mm_loadu_si128((const __m128i *)a);
+			a += 4;
+		} else {
+			v[0] = _mm_loadu_si128((const __m128i *)b);
+			b += 4;
+		}
+		sse4_merge_vecs(v, 1);
+		_mm_storeu_si128((__m128i *)out, v[0]);
+		out += 4;
+	}
+	int kept[4];
+	_mm_storeu_si128((__m128i *)kept, v[1]);
+	sort_merge_tail(kept, 4, a, a_end - a, b, b_end - b, out);
+}
+
+static inline SORT_AVX2 void
+avx2_minmax(__m256i *a, __m256i *b)
+{
+	__m256i min = _mm256_min_epi32(*a, *b);
+	*b = _mm256_max_epi32(*a, *b);
+	*a = min;
+}
+
+/** Sort a bitonic vector. */
+static inline SORT_AVX2 __m256i
+avx2_clean(__m256i v)
+{
+	__m256i t = _mm256_permute2x128_si256(v, v, 1);
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t),
+			       _mm256_max_epi32(v, t), 0xF0);
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t),
+			       _mm256_max_epi32(v, t), 0xCC);
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm256_blend_epi32(_mm256_min_epi32(v, t),
+				  _mm256_max_epi32(v, t), 0xAA);
+}
+
+/** The same as sse4_merge_vecs(), 8 numbers per vector. */
+static inline SORT_AVX2 void
+avx2_merge_vecs(__m256i *v, int n)
+{
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	for (int i = 0; i < n / 2; ++i) {
+		__m256i t = v[n + i];
+		v[n + i] = v[2 * n - 1 - i];
+		v[2 * n - 1 - i] = t;
+	}
+	for (int i = n; i < 2 * n; ++i)
+		v[i] = _mm256_permutevar8x32_epi32(v[i], reverse);
+	for (int d = n; d >= 1; d /= 2) {
+		for (int i = 0; i < 2 * n; i += 2 * d) {
+			for (int j = i; j < i + d; ++j)
+				avx2_minmax(&v[j], &v[j + d]);
+		}
+	}
+	for (int i = 0; i < 2 * n; ++i)
+		v[i] = avx2_clean(v[i]);
+}
+
+/** Sort 64 numbers in registers. */
+static SORT_AVX2 void
+avx2_sort64(int *data)
+{
+	__m256i v[8];
+	for (int i = 0; i < 8; ++i)
+		v[i] = _mm256_loadu_si256((__m256i *)data + i);
+	/* Sort the columns with the 19 comparator network. */
+	avx2_minmax(&v[0], &v[2]);
+	avx2_minmax(&v[1], &v[3]);
+	avx2_minmax(&v[4], &v[6]);
+	avx2_minmax(&v[5], &v[7]);
+	avx2_minmax(&v[0], &v[4]);
+	avx2_minmax(&v[1], &v[5]);
+	avx2_minmax(&v[2], &v[6]);
+	avx2_minmax(&v[3], &v[7]);
+	avx2_minmax(&v[0], &v[1]);
+	avx2_minmax(&v[2], &v[3]);
+	avx2_minmax(&v[4], &v[5]);
+	avx2_minmax(&v[6], &v[7]);
+	avx2_minmax(&v[2], &v[4]);
+	avx2_minmax(&v[3], &v[5]);
+	avx2_minmax(&v[1], &v[4]);
+	avx2_minmax(&v[3], &v[6]);
+	avx2_minmax(&v[1], &v[2]);
+	avx2_minmax(&v[3], &v[4]);
+	avx2_minmax(&v[5], &v[6]);
+	/* Make the sorted columns rows. */
+	__m256i t[8];
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+	}
+	__m256i u[8];
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; ++i) {
+		v[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		v[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+	for (int i = 0; i < 8; i += 2)
+		avx2_merge_vecs(&v[i], 1);
+	avx2_merge_vecs(&v[0], 2);
+	avx2_merge_vecs(&v[4], 2);
+	avx2_merge_vecs(v, 4);
+	for (int i = 0; i < 8; ++i)
+		_mm256_storeu_si256((__m256i *)data + i, v[i]);
+}
+
+/** The same as sse4_merge_two(), 8 numbers at a time. */
+static SORT_AVX2 void
+avx2_merge_two(const int *a, size_t a_count, const int *b, size_t b_count,
+	       int *out)
+{
+	if (a_count < 8 || b_count < 8) {
+		sort_merge_two(a, a_count, b, b_count, out);
+		return;
+	}
+	const int *a_end = a + a_count;
+	const int *b_end = b + b_count;
+	__m256i v[2];
+	v[0] = _mm256_loadu_si256((const __m256i *)a);
+	v[1] = _mm256_loadu_si256((const __m256i *)b);
+	a += 8;
+	b += 8;
+	avx2_merge_vecs(v, 1);
+	_mm256_storeu_si256((__m256i *)out, v[0]);
+	out += 8;
+	while (a_end - a >= 8 && b_end - b >= 8) {
+		if (*a < *b) {
+			v[0] = _mm256_loadu_si256((const __m256i *)a);
+			a += 8;
+		} else {
+			v[0] = _mm256_loadu_si256((const __m256i *)b);
+			b += 8;
+		}
+		avx2_merge_vecs(v, 1);
+		_mm256_storeu_si256((__m256i *)out, v[0]);
+		out += 8;
+	}
+	int kept[8];
+	_mm256_storeu_si256((__m256i *)kept, v[1]);
+	sort_merge_tail(kept, 8, a, a_end - a, b, b_end - b, out);
+}
+
+#endif /* SORT_USE_X86 */
+
+static enum sort_isa
+sort_isa_detect(void)
+{
+#if SORT_USE_X86
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return SORT_ISA_SCALAR;
+	bool has_sse4 = (ecx & bit_SSE4_1) != 0;
+	/* The OS has to save the YMM registers too. */
+	bool has_ymm = false;
+	if ((ecx & bit_OSXSAVE) != 0 && (ecx & bit_AVX) != 0) {
+		unsigned xcr0, xcr0_high;
+		__asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+		has_ymm = (xcr0 & 6) == 6;
+	}
+	if (has_ymm && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+	    (ebx & bit_AVX2) != 0)
+		return SORT_ISA_AVX2;
+	if (has_sse4)
+		return SORT_ISA_SSE4;
+#endif
+	return SORT_ISA_SCALAR;
+}
+
+enum sort_isa
+sort_get_isa(void)
+{
+	int isa = __atomic_load_n(&sort_isa_current, __ATOMIC_RELAXED);
+	if (isa >= 0)
+		return isa;
+	isa = sort_isa_detect();
+	__atomic_store_n(&sort_isa_best, isa, __ATOMIC_RELAXED);
+	__atomic_store_n(&sort_isa_current, isa, __ATOMIC_RELAXED);
+	return isa;
+}
+
+void
+sort_set_isa(enum sort_isa isa)
+{
+	sort_get_isa();
+	if ((int)isa > sort_isa_best)
+		isa = sort_isa_best;
+	__atomic_store_n(&sort_isa_current, isa, __ATOMIC_RELAXED);
+}
+
+const char *
+sort_isa_name(enum sort_isa isa)
+{
+	switch (isa) {
+	case SORT_ISA_SSE4:
+		return "sse4.1";
+	case SORT_ISA_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+int *
+sort_merge(int *data, size_t count, struct sort_buf *buf)
+{
+	if (count < 2)
+		return data;
+	sort_buf_reserve(buf, count);
+	sort_merge_two_f merge_two = sort_merge_two;
+	size_t width = 1;
+#if SORT_USE_X86
+	enum sort_isa isa = sort_get_isa();
+	if (isa != SORT_ISA_SCALAR) {
+		/* Sorted blocks in registers make the first pass. */
+		width = isa == SORT_ISA_AVX2 ? 64 : 16;
+		size_t i = 0;
+		for (; i + width <= count; i += width) {
+			if (isa == SORT_ISA_AVX2)
+				avx2_sort64(data + i);
+			else
+				sse4_sort16(data + i);
+		}
+		sort_insertion(data + i, count - i);
+		merge_two = isa == SORT_ISA_AVX2 ? avx2_merge_two :
+			    sse4_merge_two;
+		coro_yield_if_expired();
+	}
+#endif
+	int *src = data;
+	int *dst = buf->data;
+	for (; width < count; width *= 2) {
+		for (size_t left = 0; left < count; left += 2 * width) {
+			size_t mid = left + width < count ? left + width : count;
+			size_t right = mid + width < count ? mid + width : count;
+			merge_two(src + left, mid - left, src + mid,
+				  right - mid, dst + left);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+		coro_yield_if_expired();
+	}
+	return src;
+}
+
+enum {
+	/** Digit width for ranges up to 16 bits, fits in L1. */
+	SORT_RADIX_SMALL_BITS = 8,
+	/** Digit width for bigger ranges, 3 passes for any int. */
+	SORT_RADIX_BITS = 11,
+	SORT_RADIX_MAX_PASSES = 3,
+	/**
+	 * The auto mode takes the radix sort from this many numbers.
+	 * Below it clearing and scanning the histograms costs more
+	 * than the merge.
+	 */
+	SORT_RADIX_MIN_COUNT = 2048,
+	/**
+	 * Up to this many numbers the data and the scratch fit in L2,
+	 * and the radix sort wins with any range. Above it scattering
+	 * over 2048 buckets misses the cache so much that 3 passes
+	 * lose to the SIMD merge, only 1 or 2 passes still win.
+	 */
+	SORT_RADIX_CACHED_COUNT = 256 * 1024,
+};
+
+/** Digit width and number of passes to sort numbers in [min, max]. */
+static int
+sort_radix_passes(int min, int max, int *digit_bits)
+{
+	if (min == max)
+		return 0;
+	/* Keys are offsets from min, so a narrow range needs few digits. */
+	uint32_t range = (uint32_t)max - (uint32_t)min;
+	int bits = 32 - __builtin_clz(range);
+	*digit_bits = bits <= 2 * SORT_RADIX_SMALL_BITS ?
+		      SORT_RADIX_SMALL_BITS : SORT_RADIX_BITS;
+	return (bits + *digit_bits - 1) / *digit_bits;
+}
+
+static int *
+sort_radix_range(int *data, size_t count, struct sort_buf *buf, int min,
+		 int max)
+{
+	int digit_bits;
+	int passes = sort_radix_passes(min, max, &digit_bits);
+	if (passes == 0)
+		return data;
+	sort_buf_reserve(buf, count);
+	uint32_t mask = (1u << digit_bits) - 1;
+	size_t bucket_count = (size_t)1 << digit_bits;
+	size_t hist_size = SORT_RADIX_MAX_PASSES * ((size_t)1 << SORT_RADIX_BITS);
+	if (buf->hist == NULL) {
+		buf->hist = malloc(hist_size * sizeof(size_t));
+		if (buf->hist == NULL)
+			handle_error();
+	}
+	size_t (*hist)[1 << SORT_RADIX_BITS] = (void *)buf->hist;
+	memset(hist, 0, hist_size * sizeof(size_t));
+
+	/* Histograms of all the digits in one pass. */
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t key = (uint32_t)data[i] - (uint32_t)min;
+		for (int p = 0; p < passes; ++p)
+			++hist[p][(key >> (p * digit_bits)) & mask];
+	}
+	coro_yield_if_expired();
+
+	int *src = data;
+	int *dst = buf->data;
+	for (int p = 0; p < passes; ++p) {
+		size_t *offsets = hist[p];
+		int shift = p * digit_bits;
+		uint32_t first = ((uint32_t)src[0] - (uint32_t)min) >> shift;
+		/* All the numbers have the same digit, nothing to do. */
+		if (offsets[first & mask] == count)
+			continue;
+		size_t sum = 0;
+		for (size_t b = 0; b < bucket_count; ++b) {
+			size_t n = offsets[b];
+			offsets[b] = sum;
+			sum += n;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t key = (uint32_t)src[i] - (uint32_t)min;
+			dst[offsets[(key >> shift) & mask]++] = src[i];
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+		coro_yield_if_expired();
+	}
+	return src;
+}
+
+static void
+sort_minmax(const int *data, size_t count, int *min, int *max)
+{
+	int lo = data[0];
+	int hi = data[0];
+	for (size_t i = 1; i < count; ++i) {
+		lo = data[i] < lo ? data[i] : lo;
+		hi = data[i] > hi ? data[i] : hi;
+	}
+	*min = lo;
+	*max = hi;
+}
+
+int *
+sort_radix(int *data, size_t count, struct sort_buf *buf)
+{
+	if (count < 2)
+		return data;
+	int min, max;
+	sort_minmax(data, count, &min, &max);
+	return sort_radix_range(data, count, buf, min, max);
+}
+
+int *
+sort_numbers(int *data, size_t count, struct sort_buf *buf,
+	     enum sort_algo algo)
+{
+	switch (algo) {
+	case SORT_ALGO_MERGE:
+		return sort_merge(data, count, buf);
+	case SORT_ALGO_RADIX:
+		return sort_radix(data, count, buf);
+	default:
+		break;
+	}
+	if (count < SORT_RADIX_MIN_COUNT)
+		return sort_merge(data, count, buf);
+	int min, max;
+	sort_minmax(data, count, &min, &max);
+	int digit_bits;
+	if (count > SORT_RADIX_CACHED_COUNT &&
+	    sort_radix_passes(min, max, &digit_bits) > 2)
+		return sort_merge(data, count, buf);
+	return sort_radix_range(data, count, buf, min, max);
+}
+
+const char *
+sort_algo_name(enum sort_algo algo)
+{
+	switch (algo) {
+	case SORT_ALGO_MERGE:
+		return "merge";
+	case SORT_ALGO_RADIX:
+		return "radix";
+	default:
+		return "auto";
+	}
+}
+
+int
+sort_algo_parse(const char *name, enum sort_algo *algo)
+{
+	for (int i = SORT_ALGO_AUTO; i <= SORT_ALGO_RADIX; ++i) {
+		if (strcmp(name, sort_algo_name(i)) == 0) {
+			*algo = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/** True, if the run a wins over the run b. An empty run loses. */
+static inline bool
+sort_run_less(const struct sort_run *a, const struct sort_run *b)
+{
+	if (a->pos == a->end)
+		return false;
+	if (b->pos == b->end)
+		return true;
+	return *a->pos < *b->pos;
+}
+
+/** Play the matches of the subtree, return its winner. */
+static int
+sort_merger_build(struct sort_merger *m, int node)
+{
+	if (node >= m->run_count)
+		return node - m->run_count;
+	int left = sort_merger_build(m, 2 * node);
+	int right = sort_merger_build(m, 2 * node + 1);
+	if (sort_run_less(&m->runs[right], &m->runs[left])) {
+		m->tree[node] = left;
+		return right;
+	}
+	m->tree[node] = right;
+	return left;
+}
+
+void
+sort_merger_create(struct sort_merger *m, struct sort_run *runs,
+		   int run_count)
+{
+	m->runs = runs;
+	m->run_count = run_count;
+	for (int i = 0; i < run_count; ++i) {
+		if (runs[i].pos == runs[i].end && runs[i].refill != NULL)
+			runs[i].refill(&runs[i]);
+	}
+	m->tree = malloc((run_count > 0 ? run_count : 1) * sizeof(int));
+	if (m->tree == NULL)
+		handle_error();
+	if (run_count > 0)
+		m->tree[0] = sort_merger_build(m, 1);
+}
+
+void
+sort_merger_destroy(struct sort_merger *m)
+{
+	free(m->tree);
+}
+
+size_t
+sort_merger_next(struct sort_merger *m, int *out, size_t size)
+{
+	if (m->run_count == 0)
+		return 0;
+	int *tree = m->tree;
+	struct sort_run *runs = m->runs;
+	size_t count = 0;
+	while (count < size) {
+		int winner = tree[0];
+		struct sort_run *run = &runs[winner];
+		if (run->pos == run->end)
+			break;
+		out[count++] = *run->pos++;
+		if (run->pos == run->end && run->refill != NULL)
+			run->refill(run);
+		/*
+		 * Only the path from the winner leaf to the root has
+		 * to be replayed, against the losers stored on it.
+		 */
+		for (int node = (winner + m->run_count) / 2; node > 0;
+		     node /= 2) {
+			if (sort_run_less(&runs[tree[node]], &runs[winner])) {
+				int loser = winner;
+				winner = tree[node];
+				tree[node] = loser;
+			}
+		}
+		tree[0] = winner;
+	}
+	return count;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Sort engine of the file sorter. Merge passes go back and forth
+ * between the numbers and a scratch buffer, so nothing is
+ * allocated while sorting, and nothing is copied back after a
+ * pass. A coroutine keeps one buffer for all its files.
+ *
+ * With SSE4.1 or AVX2 the first pass sorts blocks of 16 or 64
+ * numbers in registers with sorting networks, and the merge passes
+ * use bitonic merge of 4 or 8 numbers at a time. The instruction
+ * set is chosen at runtime by CPUID.
+ *
+ * For ints there is also an LSD radix sort by 8 or 11 bit digits
+ * of the offset from the minimum, so a narrow range of values
+ * takes fewer passes.
+ */
+
+/** Instruction sets the sort engine can use. */
+enum sort_isa {
+	SORT_ISA_SCALAR,
+	SORT_ISA_SSE4,
+	SORT_ISA_AVX2,
+};
+
+/** The instruction set used now. The best supported one by default. */
+enum sort_isa
+sort_get_isa(void);
+
+/**
+ * Use another instruction set, for tests and benchmarks. One not
+ * supported by the CPU falls back to the best supported.
+ */
+void
+sort_set_isa(enum sort_isa isa);
+
+const char *
+sort_isa_name(enum sort_isa isa);
+
+/** Scratch memory of one sorting coroutine. */
+struct sort_buf {
+	int *data;
+	/** Number of ints data can hold. */
+	size_t capacity;
+	/**
+	 * Digit histograms of the radix sort, allocated on its first
+	 * use. Too big for a small coroutine stack.
+	 */
+	size_t *hist;
+};
+
+void
+sort_buf_create(struct sort_buf *buf);
+
+void
+sort_buf_destroy(struct sort_buf *buf);
+
+/** Make the buffer fit at least @a count numbers. */
+void
+sort_buf_reserve(struct sort_buf *buf, size_t count);
+
+/**
+ * Sort @a count numbers. Yields between the passes when the time
+ * slice of the coroutine is over. The result ends up either in
+ * @a data or in buf->data, the returned pointer tells which one.
+ * In the latter case the caller owns buf->data now and should
+ * give the old array to the buffer instead.
+ */
+int *
+sort_merge(int *data, size_t count, struct sort_buf *buf);
+
+/**
+ * LSD radix sort of @a count numbers. Same contract as sort_merge().
+ * Histograms of all the digits are made in one pass, the digits
+ * equal in all the numbers are skipped. Yields between the passes.
+ */
+int *
+sort_radix(int *data, size_t count, struct sort_buf *buf);
+
+/** How sort_numbers() sorts. */
+enum sort_algo {
+	/**
+	 * Radix, unless the array is small, or it is big and the
+	 * range of the values needs 3 radix passes.
+	 */
+	SORT_ALGO_AUTO,
+	SORT_ALGO_MERGE,
+	SORT_ALGO_RADIX,
+};
+
+/** Sort with the given algorithm. Same contract as sort_merge(). */
+int *
+sort_numbers(int *data, size_t count, struct sort_buf *buf,
+	     enum sort_algo algo);
+
+const char *
+sort_algo_name(enum sort_algo algo);
+
+/** Find the algorithm by its name. Returns -1 if there is none. */
+int
+sort_algo_parse(const char *name, enum sort_algo *algo);
+
+/** Merge two sorted arrays into @a out. */
+void
+sort_merge_two(const int *a, size_t a_count, const int *b, size_t b_count,
+	       int *out);
+
+/** A sorted sequence of numbers, the input of the k-way merge. */
+struct sort_run {
+	const int *pos;
+	const int *end;
+	/**
+	 * Called when [pos, end) is over, to put the next part of
+	 * the run there. It leaves pos == end when the run is over.
+	 * NULL, if the whole run is in memory.
+	 */
+	void (*refill)(struct sort_run *run);
+	/** Anything for refill. */
+	void *ctx;
+};
+
+/**
+ * K-way merge of sorted runs with a loser tree. Each taken number
+ * costs log2(k) comparisons, and the output can be taken by parts
+ * of any size, so it does not need to fit in memory at once.
+ */
+struct sort_merger {
+	struct sort_run *runs;
+	int run_count;
+	/**
+	 * tree[1..run_count - 1] are the losers of the matches,
+	 * tree[0] is the overall winner. The leaves are the runs.
+	 */
+	int *tree;
+};
+
+/** Start a merge of the runs. They are advanced while merging. */
+void
+sort_merger_create(struct sort_merger *m, struct sort_run *runs,
+		   int run_count);
+
+void
+sort_merger_destroy(struct sort_merger *m);
+
+/**
+ * Take up to @a size next numbers into @a out. Returns how many
+ * are taken, 0 when all the runs are over.
+ */
+size_t
+sort_merger_next(struct sort_merger *m, int *out, size_t size);
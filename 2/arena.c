@@ -0,0 +1,88 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <string.h>
+
+/* Enough for a line of a hundred commands with their arguments. */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock_ {
+    struct ArenaBlock_ *next;
+    char *end;
+    alignas(max_align_t) char data[];
+} typedef ArenaBlock;
+
+void arena_init(Arena *arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->pos = NULL;
+    arena->end = NULL;
+}
+
+/**
+ * @brief Start a new block big enough for size bytes
+ *
+ * @param arena is pointer to Arena
+ * @param size is number of bytes about to be allocated
+ */
+static void arena_grow(Arena *arena, size_t size) {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    block->next = NULL;
+    block->end = block->data + capacity;
+    /* The current block is always the last one. */
+    if (arena->current != NULL) {
+        arena->current->next = block;
+    } else {
+        arena->first = block;
+    }
+    arena->current = block;
+    arena->pos = block->data;
+    arena->end = block->end;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if ((size_t)(arena->end - arena->pos) < size) {
+        arena_grow(arena, size);
+    }
+    void *result = arena->pos;
+    arena->pos += size;
+    return result;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_reset(Arena *arena) {
+    if (arena->first == NULL) {
+        return;
+    }
+    /* Only the first block survives, a long line is rare. */
+    ArenaBlock *block = arena->first->next;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->current = arena->first;
+    arena->pos = arena->first->data;
+    arena->end = arena->first->end;
+}
+
+void arena_destroy(Arena *arena) {
+    arena_reset(arena);
+    free(arena->first);
+    arena_init(arena);
+}
@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * @brief Bump allocator for the data of one command line
+ *
+ * Allocation is a pointer increment in the current block. Nothing is
+ * freed one by one - the whole arena is reset after the line is
+ * executed, and its first block is reused by the next line.
+ * @param first is the block kept between the lines
+ * @param current is the block allocations come from
+ * @param pos is the first free byte of the current block
+ * @param end is the end of the current block
+ */
+struct Arena_ {
+    struct ArenaBlock_ *first;
+    struct ArenaBlock_ *current;
+    char *pos;
+    char *end;
+} typedef Arena;
+
+/**
+ * @brief First initialization of Arena. Nothing is allocated yet
+ *
+ * @param arena is pointer to Arena
+ */
+void arena_init(Arena *arena);
+
+/**
+ * @brief Allocate memory aligned for any type
+ *
+ * @param arena is pointer to Arena
+ * @param size is number of bytes
+ * @return void* valid until arena_reset()
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * @brief Copy a string into the arena
+ *
+ * @param arena is pointer to Arena
+ * @param str is string to copy
+ * @return char* valid until arena_reset()
+ */
+char *arena_strdup(Arena *arena, const char *str);
+
+/**
+ * @brief Forget all the allocations. The first block is kept for
+ * reuse, the others are freed
+ *
+ * @param arena is pointer to Arena
+ */
+void arena_reset(Arena *arena);
+
+/**
+ * @brief Free all memory of Arena
+ *
+ * @param arena is pointer to Arena
+ */
+void arena_destroy(Arena *arena);
+
+#endif // ARENA_H
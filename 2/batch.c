@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include "batch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "jobs.h"
+
+#define BATCH_READ_SIZE (64 * 1024)
+
+VEC_DECL(pollfd_vec, struct pollfd)
+
+void batch_init(Batch *batch, int limit) {
+    batch->limit = limit > 0 ? limit : 1;
+    batch->running = 0;
+    batch->head = 0;
+    batch_job_vec_create(&batch->jobs);
+    batch->status = 0;
+    batch->flushed = 0;
+    batch->use_splice = 1;
+}
+
+static int job_is_done(BatchJob *job) {
+    return job->left == 0 && job->out_fd == -1;
+}
+
+static void write_all(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t rc = write(STDOUT_FILENO, data, size);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += rc;
+        size -= rc;
+    }
+}
+
+static char **copy_strings(char **strings, int count) {
+    char **copy = malloc(count * sizeof(char *));
+    for (int i = 0; i < count; ++i) {
+        copy[i] = strdup(strings[i]);
+    }
+    return copy;
+}
+
+static void free_strings(char **strings, int count) {
+    for (int i = 0; i < count; ++i) {
+        free(strings[i]);
+    }
+    free(strings);
+}
+
+static void job_free(BatchJob *job) {
+    free(job->pids);
+    free(job->out);
+    free_strings(job->targets, job->target_count);
+    free_strings(job->words, job->word_count);
+}
+
+/* Write out what the lines in turn have, forget the finished ones. */
+static void batch_flush(Batch *batch) {
+    while (batch->head < batch->jobs.size) {
+        BatchJob *job = &batch->jobs.data[batch->head];
+        write_all(job->out, job->out_size);
+        job->out_size = 0;
+        if (!job_is_done(job)) {
+            break;
+        }
+        batch->status = job->status;
+        batch->flushed = 1;
+        job_free(job);
+        ++batch->head;
+    }
+    if (batch->head == batch->jobs.size) {
+        batch_job_vec_clear(&batch->jobs);
+        batch->head = 0;
+    }
+}
+
+static void job_finish_check(Batch *batch, BatchJob *job) {
+    if (job_is_done(job)) {
+        --batch->running;
+    }
+}
+
+static void job_close(Batch *batch, BatchJob *job) {
+    close(job->out_fd);
+    job->out_fd = -1;
+    job_finish_check(batch, job);
+}
+
+/* Returns 0 if it is not possible, and the data is still in the pipe. */
+static int batch_splice(Batch *batch, BatchJob *job) {
+    ssize_t rc = splice(job->out_fd, NULL, STDOUT_FILENO, NULL, BATCH_READ_SIZE,
+                        SPLICE_F_MOVE);
+    if (rc < 0 && errno == EINVAL) {
+        batch->use_splice = 0;
+        return 0;
+    }
+    if (rc == 0 || (rc < 0 && errno != EINTR)) {
+        job_close(batch, job);
+    }
+    return 1;
+}
+
+static void batch_read(Batch *batch, size_t index) {
+    BatchJob *job = &batch->jobs.data[index];
+    /* Its turn already: straight to stdout, not through memory. */
+    if (index == batch->head && job->out_size == 0 && batch->use_splice &&
+        batch_splice(batch, job)) {
+        return;
+    }
+    if (job->out_capacity - job->out_size < BATCH_READ_SIZE) {
+        size_t capacity = job->out_capacity * 2 > BATCH_READ_SIZE ?
+                          job->out_capacity * 2 : BATCH_READ_SIZE;
+        char *out = realloc(job->out, capacity);
+        if (out == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        job->out = out;
+        job->out_capacity = capacity;
+    }
+    ssize_t rc = read(job->out_fd, job->out + job->out_size, BATCH_READ_SIZE);
+    if (rc > 0) {
+        job->out_size += rc;
+        /* Its turn already, no need to keep it. */
+        if (index == batch->head) {
+            write_all(job->out, job->out_size);
+            job->out_size = 0;
+        }
+        return;
+    }
+    if (rc < 0 && errno == EINTR) {
+        return;
+    }
+    job_close(batch, job);
+}
+
+static void batch_reap(Batch *batch) {
+    int status;
+    pid_t pid;
+    while ((pid = jobs_reap_next(&status)) > 0) {
+        for (size_t i = batch->head; i < batch->jobs.size; ++i) {
+            BatchJob *job = &batch->jobs.data[i];
+            int j = 0;
+            while (j < job->count && job->pids[j] != pid) ++j;
+            if (j == job->count) {
+                continue;
+            }
+            job->pids[j] = -1;
+            if (j == job->count - 1) {
+                job->status = status;
+            }
+            --job->left;
+            job_finish_check(batch, job);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Wait for anything to happen to the lines or the descriptor
+ *
+ * @param batch is pointer to Batch
+ * @param fd is the descriptor, -1 - none
+ * @param block is 0 to only check what is ready
+ * @return int 1 if fd is readable
+ */
+static int batch_poll(Batch *batch, int fd, int block) {
+    struct pollfd_vec fds;
+    pollfd_vec_create(&fds);
+    pollfd_vec_push(&fds, (struct pollfd) {.fd = jobs_fd(), .events = POLLIN});
+    pollfd_vec_push(&fds, (struct pollfd) {.fd = fd, .events = POLLIN});
+    for (size_t i = batch->head; i < batch->jobs.size; ++i) {
+        pollfd_vec_push(&fds, (struct pollfd) {
+            .fd = batch->jobs.data[i].out_fd, .events = POLLIN
+        });
+    }
+
+    int rc = poll(fds.data, fds.size, block ? -1 : 0);
+    int ready = rc > 0 && fds.data[1].revents != 0;
+    if (rc > 0) {
+        for (size_t i = 2; i < fds.size; ++i) {
+            if (fds.data[i].revents != 0) {
+                batch_read(batch, batch->head + i - 2);
+            }
+        }
+        if (fds.data[0].revents != 0) {
+            batch_reap(batch);
+        }
+    }
+    pollfd_vec_destroy(&fds);
+    batch_flush(batch);
+    return ready;
+}
+
+static int intersect(char **a, int a_count, char **b, int b_count) {
+    for (int i = 0; i < a_count; ++i) {
+        for (int j = 0; j < b_count; ++j) {
+            if (strcmp(a[i], b[j]) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int batch_conflicts(Batch *batch, char **words, int word_count,
+                    char **targets, int target_count) {
+    for (size_t i = batch->head; i < batch->jobs.size; ++i) {
+        BatchJob *job = &batch->jobs.data[i];
+        if (job_is_done(job)) {
+            continue;
+        }
+        if (intersect(targets, target_count, job->targets, job->target_count) ||
+            intersect(targets, target_count, job->words, job->word_count) ||
+            intersect(words, word_count, job->targets, job->target_count)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void batch_wait_slot(Batch *batch) {
+    while (batch->running >= batch->limit) {
+        batch_poll(batch, -1, 1);
+    }
+}
+
+void batch_add(Batch *batch, const pid_t *pids, int count, int out_fd,
+               char **words, int word_count, char **targets, int target_count) {
+    BatchJob *job = batch_job_vec_append(&batch->jobs);
+    job->pids = malloc(count * sizeof(pid_t));
+    memcpy(job->pids, pids, count * sizeof(pid_t));
+    job->count = count;
+    job->left = 0;
+    for (int i = 0; i < count; ++i) {
+        job->left += pids[i] > 0;
+    }
+    job->status = 127;
+    job->out_fd = out_fd;
+    job->out = NULL;
+    job->out_size = 0;
+    job->out_capacity = 0;
+    job->targets = copy_strings(targets, target_count);
+    job->target_count = target_count;
+    job->words = copy_strings(words, word_count);
+    job->word_count = word_count;
+    ++batch->running;
+}
+
+void batch_wait_input(Batch *batch, int fd) {
+    if (fd < 0) {
+        batch_poll(batch, -1, 0);
+        return;
+    }
+    while (!batch_poll(batch, fd, 1)) {
+    }
+}
+
+int batch_drain(Batch *batch, int status) {
+    while (batch->running > 0) {
+        batch_poll(batch, -1, 1);
+    }
+    batch_flush(batch);
+    /* A line run by the shell itself since the last drain is the later one. */
+    if (batch->flushed) {
+        status = batch->status;
+        batch->flushed = 0;
+    }
+    return status;
+}
+
+void batch_destroy(Batch *batch) {
+    batch_job_vec_destroy(&batch->jobs);
+}
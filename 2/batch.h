@@ -0,0 +1,132 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <sys/types.h>
+#include "../utils/vec.h"
+
+/**
+ * @brief Command line running in a batch
+ *
+ * @param pids is the processes of the line, -1 - not started
+ * @param count is number of pids
+ * @param left is number of the processes still running
+ * @param status is exit status of the last process
+ * @param out_fd is the pipe the line writes its stdout to, -1 after EOF
+ * @param out is the output read so far, until it is the line's turn
+ * @param targets is the files the line redirects its output to
+ * @param words is the arguments of the line, maybe files it reads
+ */
+struct BatchJob_ {
+    pid_t *pids;
+    int count;
+    int left;
+    int status;
+    int out_fd;
+    char *out;
+    size_t out_size;
+    size_t out_capacity;
+    char **targets;
+    int target_count;
+    char **words;
+    int word_count;
+} typedef BatchJob;
+
+VEC_DECL(batch_job_vec, BatchJob)
+
+/**
+ * @brief Command lines running concurrently, with their output in order
+ *
+ * Up to limit lines run at once. Each one writes its stdout into its own
+ * pipe. The output of the oldest line is spliced to stdout, the others
+ * are kept in memory until all the lines before them are done, so the
+ * output is the same as if the lines ran one by one. The pipes and the
+ * signalfd of the reaper are polled together.
+ * @param limit is the most lines running at once
+ * @param running is number of lines not finished yet
+ * @param head is the oldest line which output is not written out
+ * @param status is exit status of the last written out line
+ * @param flushed is 1 if a line was written out since the last drain
+ * @param use_splice is 0 if stdout does not take splice()
+ */
+struct Batch_ {
+    int limit;
+    int running;
+    size_t head;
+    struct batch_job_vec jobs;
+    int status;
+    int flushed;
+    int use_splice;
+} typedef Batch;
+
+/**
+ * @brief First initialization of Batch
+ *
+ * @param batch is pointer to Batch
+ * @param limit is the most lines running at once
+ */
+void batch_init(Batch *batch, int limit);
+
+/**
+ * @brief Check if a line could touch the files of a running line: it
+ * writes a file a running line writes or names, or it names a file a
+ * running line writes
+ *
+ * @param batch is pointer to Batch
+ * @param words is the arguments of the line
+ * @param word_count is number of words
+ * @param targets is the files the line redirects its output to
+ * @param target_count is number of targets
+ * @return int 1 if it could
+ */
+int batch_conflicts(Batch *batch, char **words, int word_count,
+                    char **targets, int target_count);
+
+/**
+ * @brief Wait until one more line can be started
+ *
+ * @param batch is pointer to Batch
+ */
+void batch_wait_slot(Batch *batch);
+
+/**
+ * @brief Add a started line
+ *
+ * @param batch is pointer to Batch
+ * @param pids is its processes, copied
+ * @param count is number of pids
+ * @param out_fd is the read end of its stdout pipe, now owned by Batch
+ * @param words is its arguments, copied
+ * @param word_count is number of words
+ * @param targets is the files it redirects its output to, copied
+ * @param target_count is number of targets
+ */
+void batch_add(Batch *batch, const pid_t *pids, int count, int out_fd,
+               char **words, int word_count, char **targets, int target_count);
+
+/**
+ * @brief Serve the running lines until there is something to read in
+ * the descriptor
+ *
+ * @param batch is pointer to Batch
+ * @param fd is the descriptor, -1 - only serve what is ready
+ */
+void batch_wait_input(Batch *batch, int fd);
+
+/**
+ * @brief Wait for all the lines and write out their output
+ *
+ * @param batch is pointer to Batch
+ * @param status is exit status of what ran after the last drain, if no
+ * line of the batch did
+ * @return int exit status of the last line, or status
+ */
+int batch_drain(Batch *batch, int status);
+
+/**
+ * @brief Free memory of Batch. The lines must be drained
+ *
+ * @param batch is pointer to Batch
+ */
+void batch_destroy(Batch *batch);
+
+#endif // BATCH_H
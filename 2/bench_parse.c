@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lexer.h"
+
+/**
+ * Command line lexer benchmark. Generates lines of the given lengths
+ * out of plain words, quoted strings, escapes and operators, and
+ * splits them into tokens. The speed in MB/s should not depend on the
+ * line length - the lexer is linear, the old parser was quadratic and
+ * could not take a word longer than 1K at all. By default the lines are
+ * from 100 bytes to 10 MB, about 64 MB of them per length.
+ *
+ * $> gcc -O2 bench_parse.c lexer.c -o bench_parse
+ * $> ./bench_parse 1000 1000000
+ */
+
+#define BENCH_TOTAL_SIZE (64 * 1024 * 1024)
+
+static const char *pieces[] = {
+    "echo ", "'single quoted' ", "\"double \\\"quoted\\\"\" ", "esc\\ aped ",
+    "| ", "grep ", "&& ", "a_rather_long_plain_word_of_text ", "> ", "file ",
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Generate lines of about line_size bytes
+ *
+ * @param line_size is length of a line
+ * @param count is number of the lines
+ * @param size is where to save the size of the text
+ * @return char* the lines, count * (line_size + 1) bytes
+ */
+static char *generate(size_t line_size, size_t count, size_t *size) {
+    char *text = malloc(count * (line_size + 1) + 1);
+    char *pos = text;
+    size_t piece_count = sizeof(pieces) / sizeof(pieces[0]);
+    for (size_t i = 0; i < count; ++i) {
+        char *end = pos + line_size;
+        while (1) {
+            const char *piece = pieces[rand() % piece_count];
+            size_t len = strlen(piece);
+            if (pos + len > end) {
+                break;
+            }
+            memcpy(pos, piece, len);
+            pos += len;
+        }
+        while (pos < end) {
+            *pos++ = 'x';
+        }
+        *pos++ = '\n';
+    }
+    *pos = '\0';
+    *size = pos - text;
+    return text;
+}
+
+static void bench(size_t line_size) {
+    size_t count = BENCH_TOTAL_SIZE / line_size;
+    if (count == 0) {
+        count = 1;
+    }
+    size_t size;
+    char *text = generate(line_size, count, &size);
+    /* The lexer reads a descriptor: give it the text in a file. */
+    FILE *in = tmpfile();
+    fwrite(text, 1, size, in);
+    fflush(in);
+    lseek(fileno(in), 0, SEEK_SET);
+
+    Lexer lexer;
+    lexer_init(&lexer, fileno(in));
+    struct token_vec tokens;
+    token_vec_create(&tokens);
+    size_t token_count = 0;
+    long long start = now_ns();
+    while (lexer_read(&lexer, &tokens) == 0) {
+        token_count += tokens.size;
+    }
+    long long time = now_ns() - start;
+    printf("%10zu bytes x %-8zu %10.2f ms %8.2f MB/s %8.2f M tokens/s\n",
+           line_size, count, time / 1e6, size / (time / 1e3),
+           token_count / (time / 1e3));
+
+    token_vec_destroy(&tokens);
+    lexer_destroy(&lexer);
+    fclose(in);
+    free(text);
+}
+
+int main(int argc, char **argv) {
+    static const size_t default_sizes[] = {
+        100, 1000, 10000, 100000, 1000000, 10000000,
+    };
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            bench(strtoull(argv[i], NULL, 10));
+        }
+    } else {
+        size_t count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        for (size_t i = 0; i < count; ++i) {
+            bench(default_sizes[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include "builtins.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Print the char of the escape sequence after a backslash
+ *
+ * @param p points after the backslash
+ * @param out is where to print
+ * @param echo_style is 1 for echo -e and %b, where octal is \0nnn,
+ * 0 for a printf format, where it is \nnn
+ * @param stop is set to 1 by \c - no more output
+ * @return const char* the rest of the string
+ */
+static const char *put_escape(const char *p, FILE *out, int echo_style, int *stop) {
+    char c = *p++;
+    switch (c) {
+        case 'a': fputc('\a', out); break;
+        case 'b': fputc('\b', out); break;
+        case 'e': fputc(27, out); break;
+        case 'f': fputc('\f', out); break;
+        case 'n': fputc('\n', out); break;
+        case 'r': fputc('\r', out); break;
+        case 't': fputc('\t', out); break;
+        case 'v': fputc('\v', out); break;
+        case '\\': fputc('\\', out); break;
+        case 'c': *stop = 1; break;
+        case 'x': {
+            int value = 0;
+            int digits = 0;
+            for (; digits < 2; ++digits, ++p) {
+                char h = *p;
+                if (h >= '0' && h <= '9') {
+                    value = value * 16 + h - '0';
+                } else if ((h | 0x20) >= 'a' && (h | 0x20) <= 'f') {
+                    value = value * 16 + (h | 0x20) - 'a' + 10;
+                } else {
+                    break;
+                }
+            }
+            if (digits == 0) {
+                fputs("\\x", out);
+            } else {
+                fputc(value, out);
+            }
+            break;
+        }
+        case '\0': {
+            /* A backslash at the end is just a backslash. */
+            fputc('\\', out);
+            --p;
+            break;
+        }
+        default: {
+            if (c >= '0' && c <= '7') {
+                int value = echo_style ? 0 : c - '0';
+                int max_digits = echo_style && c == '0' ? 3 : 2;
+                if (echo_style && c != '0') {
+                    fputc('\\', out);
+                    fputc(c, out);
+                    break;
+                }
+                for (int i = 0; i < max_digits && *p >= '0' && *p <= '7'; ++i, ++p) {
+                    value = value * 8 + *p - '0';
+                }
+                fputc(value, out);
+            } else {
+                fputc('\\', out);
+                fputc(c, out);
+            }
+            break;
+        }
+    }
+    return p;
+}
+
+/* Print the string expanding the escapes, returns 1 if \c stopped it. */
+static int put_escaped(const char *s, FILE *out, int echo_style) {
+    int stop = 0;
+    while (*s != '\0' && !stop) {
+        if (*s == '\\') {
+            s = put_escape(s + 1, out, echo_style, &stop);
+        } else {
+            fputc(*s++, out);
+        }
+    }
+    return stop;
+}
+
+static int builtin_cd(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+    const char *path = argc > 1 ? argv[1] : getenv("HOME");
+    if (path == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(path) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_exit(int argc, char **argv) {
+    int status = last_status;
+    if (argc > 2) {
+        fprintf(stderr, "exit: too many arguments\n");
+        return 1;
+    }
+    if (argc == 2) {
+        char *end;
+        errno = 0;
+        long long value = strtoll(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || errno != 0) {
+            fprintf(stderr, "exit: %s: numeric argument required\n", argv[1]);
+            status = 2;
+        } else {
+            status = value & 0xff;
+        }
+    }
+    fflush(stdout);
+    exit(status);
+}
+
+static int builtin_true(int argc, char **argv) {
+    (void) argc;
+    (void) argv;
+    return 0;
+}
+
+static int builtin_false(int argc, char **argv) {
+    (void) argc;
+    (void) argv;
+    return 1;
+}
+
+static int builtin_pwd(int argc, char **argv) {
+    (void) argc;
+    (void) argv;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/* -n, -e and -E, as /bin/echo. */
+static int builtin_echo(int argc, char **argv) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        const char *c = argv[i] + 1;
+        while (*c == 'n' || *c == 'e' || *c == 'E') ++c;
+        /* Not an option, e.g. -x or --: printed as is. */
+        if (*c != '\0') {
+            break;
+        }
+        for (c = argv[i] + 1; *c != '\0'; ++c) {
+            if (*c == 'n') {
+                newline = 0;
+            } else {
+                escapes = *c == 'e';
+            }
+        }
+    }
+    for (int first = i; i < argc; ++i) {
+        if (i > first) {
+            putchar(' ');
+        }
+        if (!escapes) {
+            fputs(argv[i], stdout);
+        } else if (put_escaped(argv[i], stdout, 1)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+/**
+ * @brief Arguments of printf, what is missing is empty
+ *
+ * @param args is the arguments after the format
+ * @param count is number of args
+ * @param used is number of args taken
+ * @param status becomes 1 on a bad number
+ */
+struct PrintfArgs_ {
+    char **args;
+    int count;
+    int used;
+    int status;
+} typedef PrintfArgs;
+
+static const char *next_arg(PrintfArgs *args) {
+    return args->used < args->count ? args->args[args->used++] : "";
+}
+
+/* An integer argument: a number or 'c for the code of c. */
+static long long next_int(PrintfArgs *args, int is_unsigned) {
+    const char *arg = next_arg(args);
+    if (arg[0] == '\'' || arg[0] == '\"') {
+        return (unsigned char) arg[1];
+    }
+    if (arg[0] == '\0') {
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    long long value = is_unsigned ? (long long) strtoull(arg, &end, 0) : strtoll(arg, &end, 0);
+    if (*end != '\0' || end == arg || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        args->status = 1;
+    }
+    return value;
+}
+
+static long double next_float(PrintfArgs *args) {
+    const char *arg = next_arg(args);
+    if (arg[0] == '\'' || arg[0] == '\"') {
+        return (unsigned char) arg[1];
+    }
+    if (arg[0] == '\0') {
+        return 0;
+    }
+    char *end;
+    long double value = strtold(arg, &end);
+    if (*end != '\0' || end == arg) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        args->status = 1;
+    }
+    return value;
+}
+
+/**
+ * @brief Print the format once, taking the arguments it needs
+ *
+ * A conversion is passed to the printf() of libc with its flags, width
+ * and precision, the arguments are converted to the widest types.
+ * @return int 1 if the output is stopped, by \c or a bad format
+ */
+static int printf_once(const char *format, PrintfArgs *args) {
+    int stop = 0;
+    const char *p = format;
+    while (*p != '\0' && !stop) {
+        if (*p == '\\') {
+            p = put_escape(p + 1, stdout, 0, &stop);
+            continue;
+        }
+        if (*p != '%') {
+            putchar(*p++);
+            continue;
+        }
+        if (p[1] == '%') {
+            putchar('%');
+            p += 2;
+            continue;
+        }
+
+        /* "%" flags width . precision, the length is added below. */
+        char spec[64];
+        size_t len = 0;
+        const char *start = p++;
+        spec[len++] = '%';
+        while (*p != '\0' && strchr("-+ #0'", *p) != NULL && len < 8) {
+            spec[len++] = *p++;
+        }
+        if (*p == '*') {
+            len += snprintf(spec + len, 16, "%d", (int) next_int(args, 0));
+            ++p;
+        } else {
+            while (*p >= '0' && *p <= '9' && len < 24) spec[len++] = *p++;
+        }
+        if (*p == '.') {
+            spec[len++] = *p++;
+            if (*p == '*') {
+                len += snprintf(spec + len, 16, "%d", (int) next_int(args, 0));
+                ++p;
+            } else {
+                while (*p >= '0' && *p <= '9' && len < 48) spec[len++] = *p++;
+            }
+        }
+        /* The length modifiers mean nothing here. */
+        while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) ++p;
+
+        char conversion = *p++;
+        switch (conversion) {
+            case 'd':
+            case 'i':
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X': {
+                int is_unsigned = conversion != 'd' && conversion != 'i';
+                long long value = next_int(args, is_unsigned);
+                memcpy(spec + len, "ll", 2);
+                spec[len + 2] = conversion;
+                spec[len + 3] = '\0';
+                printf(spec, value);
+                break;
+            }
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                long double value = next_float(args);
+                spec[len] = 'L';
+                spec[len + 1] = conversion;
+                spec[len + 2] = '\0';
+                printf(spec, value);
+                break;
+            }
+            case 'c':
+            case 's':
+            case 'b': {
+                const char *arg = next_arg(args);
+                char first[2] = {arg[0], '\0'};
+                char *expanded = NULL;
+                if (conversion == 'c') {
+                    arg = first;
+                } else if (conversion == 'b') {
+                    size_t size;
+                    FILE *out = open_memstream(&expanded, &size);
+                    stop = put_escaped(arg, out, 1);
+                    fclose(out);
+                    arg = expanded;
+                }
+                spec[len] = 's';
+                spec[len + 1] = '\0';
+                printf(spec, arg);
+                free(expanded);
+                break;
+            }
+            default: {
+                fprintf(stderr, "printf: `%.*s': invalid format character\n",
+                        (int) (p - start), start);
+                args->status = 1;
+                return 1;
+            }
+        }
+    }
+    return stop;
+}
+
+/* The format is reused while there are arguments, as in other shells. */
+static int builtin_printf(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    PrintfArgs args = {argv + 2, argc - 2, 0, 0};
+    while (1) {
+        int used = args.used;
+        if (printf_once(argv[1], &args) || args.used >= args.count || args.used == used) {
+            break;
+        }
+    }
+    return args.status;
+}
+
+/* Sorted by name. */
+static const Builtin builtins[] = {
+    {"cd", builtin_cd, 1},
+    {"echo", builtin_echo, 0},
+    {"exit", builtin_exit, 1},
+    {"false", builtin_false, 0},
+    {"printf", builtin_printf, 0},
+    {"pwd", builtin_pwd, 0},
+    {"true", builtin_true, 0},
+};
+
+static int compare_builtin(const void *name, const void *builtin) {
+    return strcmp(name, ((const Builtin *) builtin)->name);
+}
+
+const Builtin *builtin_find(const char *name) {
+    return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(Builtin),
+                   compare_builtin);
+}
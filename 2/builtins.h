@@ -0,0 +1,29 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+/* Exit status of the last foreground pipeline, $?. */
+extern int last_status;
+
+/**
+ * @brief Command run by the shell itself, without exec
+ *
+ * @param name is the command name
+ * @param run runs it, argv is NULL-terminated, returns the exit status
+ * @param changes_shell is 1 if it makes sense only in the shell process
+ * itself, like cd, 0 if it can run anywhere, like echo
+ */
+struct Builtin_ {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    int changes_shell;
+} typedef Builtin;
+
+/**
+ * @brief Find the builtin of a command
+ *
+ * @param name is the command name
+ * @return const Builtin* the builtin, NULL if it is an external command
+ */
+const Builtin *builtin_find(const char *name);
+
+#endif // BUILTINS_H
@@ -11,6 +11,9 @@ parser.add_argument('-t', action='store_true', default=False,
 		    help='run without checks')
 parser.add_argument('--max', type=int, choices=[15, 20, 25], default=15,
 		    help='max points number')
+parser.add_argument('-P', type=int, default=4,
+		    help='max parallel lines to check the batch mode with, '\
+		    '0 to skip it')
 args = parser.parse_args()
 
 tests = [
@@ -86,10 +89,10 @@ def finish(code):
 	os.system('rm -rf testdir')
 	sys.exit(code)
 
-def open_new_shell():
-	return subprocess.Popen([args.e], shell=False, stdin=subprocess.PIPE,
-				stdout=subprocess.PIPE,
-				stderr=subprocess.STDOUT, bufsize=0)
+def open_new_shell(options=[], cwd=None):
+	return subprocess.Popen([args.e] + options, shell=False,
+				stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+				stderr=subprocess.STDOUT, bufsize=0, cwd=cwd)
 
 def exit_failure():
 	print('{}\nThe tests did not pass'.format(prefix))
@@ -212,5 +215,60 @@ if is_error:
 	      '`a` repeated {} times'.format(count))
 	exit_failure()
 
+# Test the batch mode. The lines run in parallel, but the output and the exit
+# code have to be the same as when they run one by one. Some lines depend on
+# the files written by the others, some run in the shell itself.
+tests = [
+[
+"echo 1 > a.txt",
+"cat a.txt",
+"echo 2 >> a.txt",
+"cat a.txt | wc -l",
+"seq 1 3 | tail -n 1",
+"false",
+"cd .",
+"pwd | tail -c 6",
+"true && false || echo or",
+],
+[
+"false",
+"cd .",
+],
+[
+"echo a",
+"false",
+"exit",
+"echo never",
+],
+[
+"seq 1 5",
+"false",
+"exit 3",
+],
+['echo line {}'.format(i) for i in range(100)] + ["false"],
+]
+def run_batch(command, options):
+	os.system('rm -rf testdir/batch && mkdir -p testdir/batch')
+	p = open_new_shell(options, 'testdir/batch')
+	try:
+		output = p.communicate(command.encode(), 5)[0].decode()
+	except subprocess.TimeoutExpired:
+		p.kill()
+		print('Too long no output in the batch mode')
+		exit_failure()
+	return output, p.returncode
+
+if args.P > 0:
+	for test in tests:
+		command = '\n'.join(test) + '\n'
+		expected = run_batch(command, [])
+		output = run_batch(command, ['-P', str(args.P)])
+		if output != expected:
+			print('Bad output or exit code with -P {} for:\n{}'.format(
+			      args.P, command))
+			print('Expected {}:\n{}'.format(expected[1], expected[0]))
+			print('Got {}:\n{}'.format(output[1], output[0]))
+			exit_failure()
+
 print('{}\nThe tests passed'.format(prefix))
 finish(0)
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "fanout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FANOUT_COPY_SIZE (64 * 1024)
+
+/* The fallback: through a buffer. */
+static int copy_all(int from, int to, size_t size) {
+    char buf[FANOUT_COPY_SIZE];
+    while (size > 0) {
+        ssize_t rc = read(from, buf, size < sizeof(buf) ? size : sizeof(buf));
+        if (rc <= 0) {
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < rc;) {
+            ssize_t written = write(to, buf + done, rc - done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += written;
+        }
+        size -= rc;
+    }
+    return 0;
+}
+
+/* Move size bytes from the pipe to the descriptor. */
+static int move_all(int from, int to, size_t size) {
+    while (size > 0) {
+        ssize_t rc = splice(from, NULL, to, NULL, size, SPLICE_F_MOVE);
+        if (rc > 0) {
+            size -= rc;
+        } else if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc < 0 && errno == EINVAL) {
+            /* E.g. an O_APPEND file on an older kernel. */
+            return copy_all(from, to, size);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void fanout_set_pipe_size(int fd, int size) {
+    if (size > 0) {
+        /* Too big for an unprivileged user - keep what there is. */
+        fcntl(fd, F_SETPIPE_SZ, size);
+    }
+}
+
+int fanout_run(int in_fd, const int *out_fds, int count) {
+    int scratch[2];
+    if (pipe2(scratch, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    /*
+     * As many buffers as the source has, so a tee() of what the source
+     * holds is never short.
+     */
+    fanout_set_pipe_size(scratch[0], fcntl(in_fd, F_GETPIPE_SZ));
+
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t size = tee(in_fd, scratch[1], (size_t) 1 << 30, 0);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            rc = size == 0 ? 0 : -1;
+            break;
+        }
+        for (int i = 0; i < count - 1 && rc == 0; ++i) {
+            /* The first copy is made already. */
+            if (i > 0 && tee(in_fd, scratch[1], size, 0) != size) {
+                rc = -1;
+                break;
+            }
+            rc = move_all(scratch[0], out_fds[i], size);
+        }
+        if (rc == 0) {
+            rc = move_all(in_fd, out_fds[count - 1], size);
+        }
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    return rc;
+}
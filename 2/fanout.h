@@ -0,0 +1,27 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/**
+ * @brief Copy everything from a pipe into several descriptors, until EOF
+ *
+ * The data never goes through user space: tee() duplicates what is in
+ * the pipe into a scratch pipe, and splice() moves it from there to the
+ * next descriptor. The last one gets the data straight from the source.
+ * If a descriptor does not take splice(), the data is copied to it with
+ * read() and write().
+ * @param in_fd is the read end of the pipe
+ * @param out_fds is where to copy
+ * @param count is number of out_fds, at least 2
+ * @return int 0 on success, -1 on error
+ */
+int fanout_run(int in_fd, const int *out_fds, int count);
+
+/**
+ * @brief Set size of the pipe buffer, as far as the system allows
+ *
+ * @param fd is either end of the pipe
+ * @param size is the size in bytes, 0 - keep the default
+ */
+void fanout_set_pipe_size(int fd, int size);
+
+#endif // FANOUT_H
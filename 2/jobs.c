@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include "jobs.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../utils/vec.h"
+
+VEC_DECL(pid_vec, pid_t)
+
+/* Readable when SIGCHLD is pending. */
+static int signal_fd = -1;
+/* Nobody waits for them, they are just reaped. */
+static struct pid_vec background;
+
+void jobs_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+}
+
+void jobs_add(pid_t pid) {
+    if (pid > 0) {
+        pid_vec_push(&background, pid);
+    }
+}
+
+int jobs_running(void) {
+    return background.size;
+}
+
+int jobs_fd(void) {
+    return signal_fd;
+}
+
+/* Returns 1 if pid was a background child. */
+static int forget_background(pid_t pid) {
+    for (size_t i = 0; i < background.size; ++i) {
+        if (background.data[i] == pid) {
+            background.data[i] = pid_vec_pop(&background);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int decode_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return 128 + WTERMSIG(status);
+}
+
+/*
+ * SIGCHLD does not queue, one signal can stand for many children, so
+ * the signals are only drained and the children are found by waitpid().
+ */
+pid_t jobs_reap_next(int *status) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) > 0) {
+    }
+
+    int raw;
+    pid_t pid;
+    while ((pid = waitpid(-1, &raw, WNOHANG)) > 0) {
+        if (!forget_background(pid)) {
+            *status = decode_status(raw);
+            return pid;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reap all the finished children without blocking
+ *
+ * @param pids is the foreground children, the reaped ones become -1
+ * @param statuses is where to save their exit statuses
+ * @param count is number of pids
+ * @return int number of foreground children reaped
+ */
+static int jobs_reap(pid_t *pids, int *statuses, int count) {
+    int reaped = 0;
+    int status;
+    pid_t pid;
+    while ((pid = jobs_reap_next(&status)) > 0) {
+        int j = 0;
+        while (j < count && pids[j] != pid) ++j;
+        if (j < count) {
+            pids[j] = -1;
+            statuses[j] = status;
+            ++reaped;
+        }
+    }
+    return reaped;
+}
+
+/**
+ * @brief Block until a child changes state or the fd is readable
+ *
+ * @param fd is the other descriptor to wait for, -1 - none
+ * @return int 1 if fd is readable
+ */
+static int jobs_poll(int fd) {
+    struct pollfd fds[2] = {
+        {.fd = signal_fd, .events = POLLIN},
+        {.fd = fd, .events = POLLIN},
+    };
+    int count = fd >= 0 ? 2 : 1;
+    while (poll(fds, count, -1) < 0) {
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+    return count == 2 && fds[1].revents != 0;
+}
+
+int jobs_wait(const pid_t *pids, int count) {
+    if (count == 0) {
+        return 0;
+    }
+    pid_t waiting[count];
+    int statuses[count];
+    int left = 0;
+    for (int j = 0; j < count; ++j) {
+        waiting[j] = pids[j];
+        statuses[j] = 127;
+        left += pids[j] > 0;
+    }
+    while (1) {
+        left -= jobs_reap(waiting, statuses, count);
+        if (left == 0) {
+            break;
+        }
+        jobs_poll(-1);
+    }
+    return statuses[count - 1];
+}
+
+void jobs_wait_input(int fd) {
+    jobs_reap(NULL, NULL, 0);
+    if (fd < 0) {
+        return;
+    }
+    while (!jobs_poll(fd)) {
+        jobs_reap(NULL, NULL, 0);
+    }
+}
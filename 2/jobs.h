@@ -0,0 +1,70 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/types.h>
+
+/**
+ * @brief Children of the shell, foreground and background
+ *
+ * SIGCHLD is blocked and comes through a signalfd, so there is no
+ * handler and no race: whenever the shell waits for something - a
+ * foreground pipeline or the next line of input - it also reaps all
+ * the children which have finished, and background jobs never stay
+ * zombies for long.
+ */
+
+/**
+ * @brief Block SIGCHLD and open the signalfd. Call before any child is
+ * started
+ */
+void jobs_init(void);
+
+/**
+ * @brief Remember a background child, it is reaped whenever it is done
+ *
+ * @param pid is pid of the child
+ */
+void jobs_add(pid_t pid);
+
+/**
+ * @brief Number of background children still running
+ *
+ * @return int the number
+ */
+int jobs_running(void);
+
+/**
+ * @brief Descriptor which is readable when a child has finished, to poll
+ * together with other descriptors
+ *
+ * @return int the signalfd
+ */
+int jobs_fd(void);
+
+/**
+ * @brief Reap a finished child without blocking. Background children
+ * are reaped silently
+ *
+ * @param status is where to save its exit status
+ * @return pid_t pid of the child, 0 if no other child has finished
+ */
+pid_t jobs_reap_next(int *status);
+
+/**
+ * @brief Wait for foreground children, reaping the others meanwhile
+ *
+ * @param pids is the children, -1 - a child which was not started
+ * @param count is number of pids
+ * @return int exit status of the last child, 127 if it was not started
+ */
+int jobs_wait(const pid_t *pids, int count);
+
+/**
+ * @brief Reap the finished children, then wait until there is something
+ * to read in the descriptor, reaping the children meanwhile
+ *
+ * @param fd is the descriptor, -1 - do not wait
+ */
+void jobs_wait_input(int fd);
+
+#endif // JOBS_H
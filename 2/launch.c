@@ -0,0 +1,55 @@
+#include "launch.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pathcache.h"
+
+extern char **environ;
+
+pid_t launch(char **argv, int in_fd, int out_fd, const char *file, int append) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    /* After the pipe, so the file wins, as in other shells. */
+    if (file != NULL) {
+        int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, file, flags, mode);
+    }
+
+    /* The shell blocks SIGCHLD for its reaper, the program must not. */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    /* The program is found in the cache, not by exec() in each directory. */
+    pid_t pid;
+    int rc = -1;
+    const char *path = pathcache_lookup(argv[0]);
+    if (path != NULL) {
+        rc = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        /* Gone since it was cached? Look again. */
+        if (rc != 0 && path != argv[0]) {
+            pathcache_forget(argv[0]);
+            path = pathcache_lookup(argv[0]);
+            if (path != NULL) {
+                rc = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+            }
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return rc == 0 ? pid : -1;
+}
@@ -0,0 +1,23 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+
+/**
+ * @brief Start a program without fork()
+ *
+ * posix_spawnp() does not copy the page tables of the shell: glibc
+ * starts the child with vfork semantics, in the memory of the shell,
+ * and it only execs. Whatever the child must do with the descriptors
+ * is passed as file actions, which it applies before exec. The
+ * program is found in $PATH through pathcache.
+ * @param argv is the program and its arguments, NULL-terminated
+ * @param in_fd becomes stdin of the program
+ * @param out_fd becomes stdout of the program
+ * @param file is where to redirect stdout then, NULL - nowhere
+ * @param append is 1 for >>, 0 for >
+ * @return pid_t pid of the program, -1 if it could not be started
+ */
+pid_t launch(char **argv, int in_fd, int out_fd, const char *file, int append);
+
+#endif // LAUNCH_H
@@ -0,0 +1,306 @@
+#include "lexer.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Bytes asked from the descriptor at once. */
+#define LEXER_READ_SIZE (64 * 1024)
+
+enum Quote_ {
+    QUOTE_NONE,
+    QUOTE_SINGLE,
+    QUOTE_DOUBLE,
+} typedef Quote;
+
+void lexer_init(Lexer *lexer, int fd) {
+    lexer->fd = fd;
+    lexer->in = NULL;
+    lexer->in_pos = 0;
+    lexer->in_end = 0;
+    lexer->buf = NULL;
+    lexer->size = 0;
+    lexer->capacity = 0;
+    lexer->more = NULL;
+    lexer->more_capacity = 0;
+}
+
+/**
+ * @brief Make the buffer hold at least need bytes
+ *
+ * @param buf is pointer to the buffer
+ * @param capacity is pointer to allocated size of the buffer
+ * @param need is the size needed
+ */
+static void grow(char **buf, size_t *capacity, size_t need) {
+    if (need <= *capacity) {
+        return;
+    }
+    size_t new_capacity = *capacity * 2 > need ? *capacity * 2 : need;
+    char *new_buf = realloc(*buf, new_capacity);
+    if (new_buf == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    *buf = new_buf;
+    *capacity = new_capacity;
+}
+
+/**
+ * @brief Take the next line of the input, with its '\n', like getline()
+ *
+ * A read error ends the input, as it does for getline().
+ * @param lexer is pointer to Lexer
+ * @param line is pointer to the buffer of the line, NUL-terminated
+ * @param capacity is pointer to allocated size of the buffer
+ * @return ssize_t length of the line, -1 at the end of the input
+ */
+static ssize_t lexer_getline(Lexer *lexer, char **line, size_t *capacity) {
+    if (lexer->in == NULL) {
+        lexer->in = malloc(LEXER_READ_SIZE);
+        if (lexer->in == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    size_t len = 0;
+    while (true) {
+        char *start = lexer->in + lexer->in_pos;
+        size_t avail = lexer->in_end - lexer->in_pos;
+        char *newline = avail > 0 ? memchr(start, '\n', avail) : NULL;
+        size_t take = newline != NULL ? (size_t)(newline - start) + 1 : avail;
+        grow(line, capacity, len + take + 1);
+        memcpy(*line + len, start, take);
+        len += take;
+        lexer->in_pos += take;
+        if (newline != NULL) {
+            break;
+        }
+        ssize_t rc;
+        do {
+            rc = read(lexer->fd, lexer->in, LEXER_READ_SIZE);
+        } while (rc < 0 && errno == EINTR);
+        if (rc <= 0) {
+            break;
+        }
+        lexer->in_pos = 0;
+        lexer->in_end = rc;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    (*line)[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief Append the next line of the input to the line buffer
+ *
+ * The buffer can move, so the tokens keep offsets until the end.
+ * @param lexer is pointer to Lexer
+ * @return bool false at the end of the stream
+ */
+static bool lexer_read_more(Lexer *lexer) {
+    ssize_t len = lexer_getline(lexer, &lexer->more, &lexer->more_capacity);
+    if (len <= 0) {
+        return false;
+    }
+    grow(&lexer->buf, &lexer->capacity, lexer->size + len + 1);
+    memcpy(lexer->buf + lexer->size, lexer->more, len + 1);
+    lexer->size += len;
+    return true;
+}
+
+/**
+ * @brief Emit an operator token, one or two chars long
+ *
+ * @param tokens is where to push the token
+ * @param next is the char after the operator's first one
+ * @param single is the token of the one char operator
+ * @param twice is the token of the doubled char, e.g. || for |
+ * @param c is the operator's first char
+ * @return size_t number of chars taken
+ */
+static size_t push_operator(struct token_vec *tokens, char c, char next,
+                            TokenType single, TokenType twice) {
+    Token *token = token_vec_append(tokens);
+    token->offset = 0;
+    token->text = NULL;
+    if (next == c) {
+        token->type = twice;
+        return 2;
+    }
+    token->type = single;
+    return 1;
+}
+
+/**
+ * @brief Split the line buffer into tokens
+ *
+ * One pass over the line: read is where the next char comes from, write is
+ * where the next char of the current word goes. The word never gets longer
+ * than its source, so write never passes read, and the word is built right
+ * in the buffer.
+ * @param lexer is pointer to Lexer with the line in its buffer
+ * @param tokens is where to push the tokens
+ */
+static void lexer_split(Lexer *lexer, struct token_vec *tokens) {
+    size_t read = 0;
+    size_t write = 0;
+    size_t start = 0;
+    bool in_word = false;
+    bool continued = false;
+    Quote quote = QUOTE_NONE;
+
+#define begin_word()                                                    \
+    if (!in_word) {                                                     \
+        in_word = true;                                                 \
+        start = read;                                                   \
+        write = read;                                                   \
+    }
+
+#define end_word()                                                      \
+    if (in_word) {                                                      \
+        in_word = false;                                                \
+        lexer->buf[write] = '\0';                                       \
+        Token *token = token_vec_append(tokens);                        \
+        token->type = TOKEN_WORD;                                       \
+        token->offset = start;                                          \
+    }
+
+    while (1) {
+        if (read == lexer->size) {
+            /* An open quote or a backslash-newline: the line goes on. */
+            if ((quote != QUOTE_NONE || continued) && lexer_read_more(lexer)) {
+                continued = false;
+                continue;
+            }
+            break;
+        }
+        char *buf = lexer->buf;
+        char c = buf[read];
+        char next = buf[read + 1];
+        continued = false;
+
+        if (quote == QUOTE_SINGLE) {
+            if (c == '\'') {
+                quote = QUOTE_NONE;
+                ++read;
+            } else {
+                buf[write++] = buf[read++];
+            }
+            continue;
+        }
+        if (quote == QUOTE_DOUBLE) {
+            if (c == '\"') {
+                quote = QUOTE_NONE;
+                ++read;
+            } else if (c == '\\' && next == '\n') {
+                read += 2;
+            } else if (c == '\\' && (next == '\"' || next == '\\' ||
+                                     next == '$' || next == '`')) {
+                buf[write++] = next;
+                read += 2;
+            } else {
+                buf[write++] = buf[read++];
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '\\': {
+                if (next == '\n') {
+                    read += 2;
+                    continued = true;
+                } else if (next == '\0') {
+                    ++read;
+                } else {
+                    begin_word()
+                    buf[write++] = next;
+                    read += 2;
+                }
+                break;
+            }
+            case '\'':
+            case '\"': {
+                begin_word()
+                quote = c == '\'' ? QUOTE_SINGLE : QUOTE_DOUBLE;
+                ++read;
+                break;
+            }
+            case ' ':
+            case '\t': {
+                end_word()
+                ++read;
+                break;
+            }
+            case '\n': {
+                end_word()
+                goto done;
+            }
+            case '#': {
+                if (!in_word) {
+                    goto done;
+                }
+                buf[write++] = buf[read++];
+                break;
+            }
+            case '|': {
+                end_word()
+                read += push_operator(tokens, c, next, TOKEN_PIPE, TOKEN_OR);
+                break;
+            }
+            case '&': {
+                end_word()
+                read += push_operator(tokens, c, next, TOKEN_BACKGROUND, TOKEN_AND);
+                break;
+            }
+            case '>': {
+                end_word()
+                read += push_operator(tokens, c, next, TOKEN_WRITE, TOKEN_APPEND);
+                break;
+            }
+            default: {
+                begin_word()
+                buf[write++] = buf[read++];
+                break;
+            }
+        }
+    }
+    end_word()
+done:
+    for (size_t i = 0; i < tokens->size; ++i) {
+        Token *token = &tokens->data[i];
+        if (token->type == TOKEN_WORD) {
+            token->text = lexer->buf + token->offset;
+        }
+    }
+
+#undef begin_word
+#undef end_word
+}
+
+int lexer_read(Lexer *lexer, struct token_vec *tokens) {
+    token_vec_clear(tokens);
+    ssize_t len = lexer_getline(lexer, &lexer->buf, &lexer->capacity);
+    if (len == -1) {
+        return -1;
+    }
+    lexer->size = len;
+    lexer_split(lexer, tokens);
+    return 0;
+}
+
+int lexer_is_buffered(Lexer *lexer) {
+    return lexer->in_pos < lexer->in_end;
+}
+
+void lexer_destroy(Lexer *lexer) {
+    free(lexer->in);
+    free(lexer->buf);
+    free(lexer->more);
+    lexer_init(lexer, -1);
+}
@@ -0,0 +1,100 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+#include "../utils/vec.h"
+
+enum TokenType_ {
+    TOKEN_WORD,
+    /* | */
+    TOKEN_PIPE,
+    /* || */
+    TOKEN_OR,
+    /* & */
+    TOKEN_BACKGROUND,
+    /* && */
+    TOKEN_AND,
+    /* > */
+    TOKEN_WRITE,
+    /* >> */
+    TOKEN_APPEND,
+} typedef TokenType;
+
+/**
+ * @brief Token of a command line
+ * @param type is kind of the token
+ * @param offset is where the word starts in the line buffer
+ * @param text is the word, NUL-terminated, in the line buffer
+ */
+struct Token_ {
+    TokenType type;
+    size_t offset;
+    char *text;
+} typedef Token;
+
+VEC_DECL(token_vec, Token)
+
+/**
+ * @brief Splits command lines into tokens in one pass
+ *
+ * The words are not copied anywhere: quotes and escapes are removed
+ * in place, in the line buffer, and the words are terminated there.
+ * A word can be of any length. A line continues on the next one after
+ * a backslash at the end or inside unclosed quotes. The input is read
+ * by the lexer itself, so it knows what is read ahead.
+ * @param fd is the descriptor to read the lines from
+ * @param in is the input read from fd, not split into lines yet
+ * @param in_pos is where the next line starts in in
+ * @param in_end is length of the data in in
+ * @param buf is the line buffer, reused by all the lines
+ * @param size is length of the data in buf
+ * @param capacity is allocated size of buf
+ * @param more is the line buffer for the continuation lines
+ */
+struct Lexer_ {
+    int fd;
+    char *in;
+    size_t in_pos;
+    size_t in_end;
+    char *buf;
+    size_t size;
+    size_t capacity;
+    char *more;
+    size_t more_capacity;
+} typedef Lexer;
+
+/**
+ * @brief First initialization of Lexer
+ *
+ * @param lexer is pointer to Lexer
+ * @param fd is the descriptor to read the lines from
+ */
+void lexer_init(Lexer *lexer, int fd);
+
+/**
+ * @brief Read the next command line and split it into tokens
+ *
+ * @param lexer is pointer to Lexer
+ * @param tokens is cleared and filled with the tokens, the words are
+ * valid until the next call
+ * @return int 0 on success, -1 at the end of the stream
+ */
+int lexer_read(Lexer *lexer, struct token_vec *tokens);
+
+/**
+ * @brief Check if the next line can be read without waiting: the lexer
+ * has already read it ahead from the descriptor
+ *
+ * @param lexer is pointer to Lexer
+ * @return int 1 if there is buffered input
+ */
+int lexer_is_buffered(Lexer *lexer);
+
+/**
+ * @brief Free memory of Lexer
+ *
+ * @param lexer is pointer to Lexer
+ */
+void lexer_destroy(Lexer *lexer);
+
+#endif // LEXER_H
@@ -1,24 +1,42 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
-#include "Vector/Vector.h"
-#include <sys/stat.h>
+#include <string.h>
+#include "../utils/vec.h"
+#include "arena.h"
+#include "lexer.h"
+#include "launch.h"
+#include "jobs.h"
+#include "batch.h"
+#include "fanout.h"
+#include "builtins.h"
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+struct Redirect_ {
+    int mode_write; // 1 is >
+    // 2 is >>
+    char *write_to_file;
+} typedef Redirect;
 
 struct Cmd_ {
-    char *argv[128];
+    char **argv;
     int last_elem;
     int background; // if 1 - is background
-    int mode_write;
-    char *write_to_file;
+    /* More than one - the output goes to all of them. */
+    Redirect *redirects;
+    int redirect_count;
 } typedef Cmd;
 
 void init_cmd(Cmd *cmd) {
-//    init_vector(&cmd->argv, sizeof(char *));
+    cmd->argv = NULL;
     cmd->background = 0;
     cmd->last_elem = 0;
-    cmd->write_to_file = NULL;
-    cmd->mode_write = 0;
+    cmd->redirects = NULL;
+    cmd->redirect_count = 0;
 }
 
 enum NextCommand_ {
@@ -28,358 +46,553 @@ enum NextCommand_ {
     NONE
 } typedef NextCommand;
 
+VEC_DECL(cmd_vec, Cmd)
+VEC_DECL(next_vec, NextCommand)
+
 struct LineCmd_ {
-    Vector/*<Cmd>*/ cmds;
-    Vector/*<NextCommand*>*/ nexts;
+    struct cmd_vec cmds;
+    struct next_vec nexts;
 } typedef LineCmd;
 
 void init_line_cmd(LineCmd *lineCmd) {
-    init_vector(&lineCmd->cmds, sizeof(Cmd));
-    init_vector(&lineCmd->nexts, sizeof(NextCommand *));
-}
-
-void write_to_string(char *string, char x) {
-    size_t old_len = strlen(string);
-    string[old_len] = x;
-    string[old_len + 1] = '\0';
+    cmd_vec_create(&lineCmd->cmds);
+    next_vec_create(&lineCmd->nexts);
 }
 
-#define add_command_and_clear(cmd, lineCmd, string, first_command)      \
-    if (write_to_file) {                                                \
-        Cmd temp = *(Cmd*)get(&lineCmd.cmds, lineCmd.cmds.size - 1);    \
-        temp.write_to_file = strdup(string);                            \
-        temp.mode_write = write_to_file;                                \
-        set(&lineCmd.cmds, lineCmd.cmds.size - 1, &temp);               \
-    } else {                                                            \
-        if (!was_space){                                                \
-            cmd.argv[cmd.last_elem++] = strdup(string);                 \
-        }                                                               \
-        push_back(&lineCmd.cmds, (void*)&cmd);                          \
-        init_cmd(&cmd);                                                 \
-        first_command = 0;                                              \
-        string[0] = '\0';                                               \
-        was_space = 0;                                                  \
-    }
-
-
-#define reread_line(line)   \
-i = -1;                     \
-if (line_change)free(line); \
-size_t sz = 0;              \
-line_change = 1;            \
-getline(&line, &sz, stdin);
-
-LineCmd parse(char *line) {
-    NextCommand temp_command;
-
-    LineCmd lineCmd;
-    init_line_cmd(&lineCmd);
-
-    Cmd cmd;
-    init_cmd(&cmd);
-
-    char string[1024];
-    string[0] = '\0';
+/* Strings and arrays of the current line, freed at once after it. */
+Arena line_arena;
 
-    int line_change = 0;
+/* Fills the line buffer and splits it into the tokens. */
+Lexer lexer;
+struct token_vec tokens;
 
-    int first_command = 0;
-    int was_space = 0;
+/* Lines running concurrently in the batch mode, -P. */
+int batch_mode = 0;
+Batch batch;
 
-    int single_quote_is_open = 0;
-    int double_quote_is_open = 0;
-
-    int write_to_file = 0; // 1 is >
-    // 2 is >>
+static int is_separator(TokenType type) {
+    return type == TOKEN_PIPE || type == TOKEN_OR || type == TOKEN_AND ||
+           type == TOKEN_BACKGROUND;
+}
 
-    int comment = 0;
+static int is_redirect(TokenType type) {
+    return type == TOKEN_WRITE || type == TOKEN_APPEND;
+}
 
-    for (int i = 0; i < strlen(line); ++i) {
-        if (comment) {
-            break;
-        }
-        switch (line[i]) {
-            case '#': {
-                comment = 1;
-                break;
-            }
-            case '&': {
-                if (single_quote_is_open == 0 && double_quote_is_open == 0) {
-                    if (i + 1 < strlen(line) && line[i + 1] == '&') { // &&
-                        temp_command = AND;
-                        push_back(&lineCmd.nexts,(void*) &temp_command);
-                    } else { // &
-                        cmd.background = 1;
-                    }
-
-                    add_command_and_clear(cmd, lineCmd, string, first_command)
-                } else {
-                    write_to_string(string, line[i]);
-                }
-                break;
-            }
-            case '|': {
-                if (single_quote_is_open == 0 && double_quote_is_open == 0) {
-                    if (i + 1 < strlen(line) && line[i + 1] == '|') { // ||
-                        temp_command = OR;
-                        push_back(&lineCmd.nexts, (void *) &temp_command);
-                        ++i;
-                    } else { // |
-                        temp_command = PIPE;
-                        push_back(&lineCmd.nexts, (void *) &temp_command);
-                    }
-
-                    add_command_and_clear(cmd, lineCmd, string, first_command)
-                } else {
-                    write_to_string(string, line[i]);
-                }
-                break;
-            }
-            case '>': {
-                if (single_quote_is_open == 0 && double_quote_is_open == 0) {
-                    if (i + 1 < strlen(line) && line[i + 1] == '>') { // >>
-                        write_to_file = 2;
-                        ++i;
-                    } else { // >
-                        write_to_file = 1;
-                    }
-                    first_command = 0;
-                } else {
-                    write_to_string(string, line[i]);
-                }
-                break;
-            }
-            case '\'': {
-                if (double_quote_is_open == 0) {
-                    single_quote_is_open = 1 - single_quote_is_open;
-                } else write_to_string(string, line[i]);
-                break;
+/* Fill the cleared lineCmd with the commands of the tokens. */
+void parse(LineCmd *lineCmd, struct token_vec *tokens) {
+    size_t i = 0;
+    while (i < tokens->size) {
+        Cmd cmd;
+        init_cmd(&cmd);
+
+        /* The words up to a separator, except the file names, are argv. */
+        size_t end = i;
+        int argc = 0;
+        int redirect_count = 0;
+        for (; end < tokens->size && !is_separator(tokens->data[end].type); ++end) {
+            if (is_redirect(tokens->data[end].type)) {
+                ++redirect_count;
+            } else if (end == i || !is_redirect(tokens->data[end - 1].type)) {
+                ++argc;
             }
-            case '\"': {
-                if (single_quote_is_open == 0) {
-                    double_quote_is_open = 1 - double_quote_is_open;
-                } else write_to_string(string, line[i]);
-                break;
-            }
-            case '\\': {
-                if (i + 1 < strlen(line)) {
-                    if (line[i + 1] == '\\' || line[i + 1] == ' ') {
-                        write_to_string(string, line[++i]);
-                    } else if (
-                            (single_quote_is_open == 1 && line[i + 1] == '\'') ||
-                                    (double_quote_is_open == 1 && line[i + 1] == '\"')) {
-                        write_to_string(string, line[i++]);
-                        write_to_string(string, line[i]);
-                    } else if (
-                            single_quote_is_open == 0 && double_quote_is_open == 0 && line[i + 1] == '\n'
-                            ) {
-                        reread_line(line)
-                    }
-                }
-                break;
-            }
-            case ' ': {
-                was_space = 1;
-                if (single_quote_is_open == 1 || double_quote_is_open == 1) {
-                    write_to_string(string, line[i]);
-                } else if (first_command) {
-                    cmd.argv[cmd.last_elem++] = strdup(string);
-                    string[0] = '\0';
-                }
-                break;
-            }
-            case '\n': {
-                if (single_quote_is_open || double_quote_is_open) {
-                    write_to_string(string, line[i]);
-                    reread_line(line)
+        }
+        cmd.argv = arena_alloc(&line_arena, (argc + 1) * sizeof(char *));
+        cmd.redirects = arena_alloc(&line_arena, redirect_count * sizeof(Redirect));
+        for (; i < end; ++i) {
+            Token *token = &tokens->data[i];
+            if (is_redirect(token->type)) {
+                if (i + 1 < end && tokens->data[i + 1].type == TOKEN_WORD) {
+                    Redirect *redirect = &cmd.redirects[cmd.redirect_count++];
+                    redirect->mode_write = token->type == TOKEN_WRITE ? 1 : 2;
+                    redirect->write_to_file = tokens->data[++i].text;
                 }
-                break;
+            } else {
+                cmd.argv[cmd.last_elem++] = token->text;
             }
-            default: {
-                was_space = 0;
-                first_command = 1;
-                write_to_string(string, line[i]);
-                break;
+        }
+        cmd.argv[cmd.last_elem] = NULL;
+
+        NextCommand next = NONE;
+        if (i < tokens->size) {
+            switch (tokens->data[i++].type) {
+                case TOKEN_PIPE: next = PIPE; break;
+                case TOKEN_OR: next = OR; break;
+                case TOKEN_AND: next = AND; break;
+                default: cmd.background = 1; break;
             }
         }
+        cmd_vec_push(&lineCmd->cmds, cmd);
+        next_vec_push(&lineCmd->nexts, next);
     }
-
-    if (write_to_file) {
-        cmd.mode_write = write_to_file;
-        cmd.write_to_file = strdup(string);
-    } else if (first_command) {
-        cmd.argv[cmd.last_elem++] = strdup(string);
-    }
-
-    push_back(&lineCmd.cmds, (void *) &cmd);
-
-    temp_command = NONE;
-    push_back(&lineCmd.nexts, (void *) &temp_command);
-
-    if(line_change) {
-        free(line);
+    /* Nothing after the last operator. */
+    if (lineCmd->nexts.size > 0) {
+        lineCmd->nexts.data[lineCmd->nexts.size - 1] = NONE;
     }
-    return lineCmd;
 }
 
-char *read_line() {
-    char *line = NULL;
-    size_t bufferSize = 0;
-
-    if (getline(&line, &bufferSize, stdin) == -1) {
-        exit(EXIT_FAILURE);
+void read_line(void) {
+    int fd = lexer_is_buffered(&lexer) ? -1 : STDIN_FILENO;
+    if (batch_mode) {
+        batch_wait_input(&batch, fd);
+    } else {
+        jobs_wait_input(fd);
+    }
+    if (lexer_read(&lexer, &tokens) == -1) {
+        if (batch_mode) {
+            last_status = batch_drain(&batch, last_status);
+        }
+        /* As if the script ended with exit. */
+        exit(last_status);
     }
-
-    return line;
 }
 
 void print_line_cmd(LineCmd lineCmd) {
-    for (int i = 0; i < lineCmd.cmds.size; ++i) {
-        Cmd *cmd = (Cmd *) get(&lineCmd.cmds, i);
+    for (size_t i = 0; i < lineCmd.cmds.size; ++i) {
+        Cmd *cmd = &lineCmd.cmds.data[i];
         printf("Name: %s\nArgv:\n", cmd->argv[0]);
         for (int j = 0; j < cmd->last_elem; ++j) {
             printf("!\t%s\n", cmd->argv[j]);
         }
 
-        printf("Mode write to file: %d\n", cmd->mode_write);
-        if (cmd->mode_write) {
-            printf("Filename: %s\n", cmd->write_to_file);
+        for (int j = 0; j < cmd->redirect_count; ++j) {
+            printf("Mode write to file: %d\n", cmd->redirects[j].mode_write);
+            printf("Filename: %s\n", cmd->redirects[j].write_to_file);
         }
     }
 }
 
-void execute_chdir(Cmd cmd) {
-    if (strcmp(cmd.argv[0], "cd") == 0) {
-        char *path = cmd.argv[1];
-        if (chdir(path) != 0) {
-            printf("cd: %s: No such file or directory\n", path);
+int last_status = 0;
+
+/* Builtin of the command, NULL for an external one. */
+const Builtin *find_builtin(Cmd *cmd) {
+    return cmd->last_elem > 0 ? builtin_find(cmd->argv[0]) : NULL;
+}
+
+int open_redirect(Redirect *redirect) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                (redirect->mode_write == 2 ? O_APPEND : O_TRUNC);
+    return open(redirect->write_to_file, flags, 0664);
+}
+
+/*
+ * Run the builtin in the shell itself, with its output redirected to a
+ * file for the time of it. Returns its exit status.
+ */
+int execute_builtin(const Builtin *builtin, Cmd *cmd) {
+    int saved_stdout = -1;
+    if (cmd->redirect_count == 1) {
+        int fd = open_redirect(&cmd->redirects[0]);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", cmd->redirects[0].write_to_file, strerror(errno));
+            return 1;
         }
-        return;
+        fflush(stdout);
+        saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
     }
+    int status = builtin->run(cmd->last_elem, cmd->argv);
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    return status;
+}
 
+/* Size of the pipes the shell makes, -S. 0 - the system default. */
+int pipe_size = 0;
+
+void make_pipe(int fd[2]) {
+    pipe2(fd, O_CLOEXEC);
+    fanout_set_pipe_size(fd[1], pipe_size);
 }
 
-#define NEED_WRITE(current_cmd)                                 \
-if (current_cmd->mode_write != 0) {                             \
-    int flags = O_WRONLY | O_CREAT;                             \
-    int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH; \
-    if (current_cmd->mode_write == 1) {                         \
-        flags |= O_TRUNC;                                       \
-    } else {                                                    \
-        flags |= O_APPEND;                                      \
-    }                                                           \
-    int filedf = open(                                          \
-                    current_cmd->write_to_file,                 \
-                    flags, mode);                               \
-    dup2(filedf, STDOUT_FILENO);                                \
+/*
+ * Fork a helper which copies everything from in_fd to all the redirect
+ * files of cmd, as zsh does for several > of one command.
+ */
+pid_t start_fanout(Cmd *cmd, int in_fd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    /* Other pipes of the shell must see EOF without waiting for us. */
+    dup2(in_fd, STDIN_FILENO);
+    close_range(STDERR_FILENO + 1, ~0U, 0);
+
+    int *fds = arena_alloc(&line_arena, cmd->redirect_count * sizeof(int));
+    for (int i = 0; i < cmd->redirect_count; ++i) {
+        fds[i] = open_redirect(&cmd->redirects[i]);
+        if (fds[i] < 0) {
+            _exit(1);
+        }
+    }
+    _exit(fanout_run(STDIN_FILENO, fds, cmd->redirect_count) == 0 ? 0 : 1);
 }
 
-void execute_line_cmd(LineCmd lineCmd) {
-    for (int i = 0; i < lineCmd.cmds.size; ++i) {
-        NextCommand nextCommand = *(NextCommand *) get(&lineCmd.nexts, i);
-        {
-            Cmd *temp_cmd = (Cmd *) get(&lineCmd.cmds, i);
-            execute_chdir(*temp_cmd);
+/*
+ * Fork a child which runs the builtin, there is nothing to exec. What the
+ * file actions do for a program is done here by hand.
+ */
+pid_t start_builtin(const Builtin *builtin, Cmd *cmd, int in_fd, int out_fd, Redirect *redirect) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    if (in_fd != STDIN_FILENO) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    if (redirect != NULL) {
+        int fd = open_redirect(redirect);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", redirect->write_to_file, strerror(errno));
+            _exit(1);
         }
-        if (nextCommand == PIPE) {
-            int current = i;
-            int end = i + 1;
+        dup2(fd, STDOUT_FILENO);
+    }
+    /* Other pipes of the shell must see EOF without waiting for us. */
+    close_range(STDERR_FILENO + 1, ~0U, 0);
+    int status = builtin->run(cmd->last_elem, cmd->argv);
+    fflush(stdout);
+    _exit(status);
+}
+
+/*
+ * Start the command with the given stdin and stdout, -1 if nothing started.
+ * The helper copying the output to several files is saved in helper.
+ */
+pid_t launch_cmd(Cmd *cmd, int in_fd, int out_fd, pid_t *helper) {
+    *helper = -1;
+    if (cmd->last_elem == 0) {
+        return -1;
+    }
+    Redirect *redirect = cmd->redirect_count == 1 ? &cmd->redirects[0] : NULL;
+    int fan[2] = {-1, -1};
+    if (cmd->redirect_count > 1) {
+        make_pipe(fan);
+        out_fd = fan[1];
+    }
 
-            while (end < lineCmd.nexts.size && *(NextCommand *) get(&lineCmd.nexts, end) == PIPE) ++end;
+    pid_t pid;
+    const Builtin *builtin = find_builtin(cmd);
+    if (builtin != NULL) {
+        pid = start_builtin(builtin, cmd, in_fd, out_fd, redirect);
+    } else if (redirect != NULL) {
+        pid = launch(cmd->argv, in_fd, out_fd, redirect->write_to_file,
+                     redirect->mode_write == 2);
+    } else {
+        pid = launch(cmd->argv, in_fd, out_fd, NULL, 0);
+    }
 
-            int fd[2], prev_fd[2];
-            pipe(fd);
+    if (fan[0] != -1) {
+        /* The helper must not get the write end, or it never sees EOF. */
+        close(fan[1]);
+        *helper = start_fanout(cmd, fan[0]);
+        close(fan[0]);
+    }
+    return pid;
+}
 
-            pid_t *pids = calloc(end - current + 1, sizeof(pid_t));
-            for (; current <= end; ++current) {
-                prev_fd[0] = fd[0];
-                prev_fd[1] = fd[1];
-                pipe(fd);
+/* Without job control background jobs read nothing, as in other shells. */
+int open_background_stdin(void) {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
 
-                if ((pids[current - i] = fork()) == 0) {
-                    Cmd *current_cmd = (Cmd *) get(&lineCmd.cmds, current);
+/*
+ * Start the pipeline of cmds[begin..end] reading in_fd and writing out_fd.
+ * pids gets 2 * (end - begin + 1) pids: the fanout helpers, then the
+ * commands, so the last one is the one the status comes from. The
+ * descriptors stay open.
+ */
+void start_pipeline(LineCmd *lineCmd, int begin, int end, int in_fd, int out_fd, pid_t *pids) {
+    int size = end - begin + 1;
+    for (int current = begin; current <= end; ++current) {
+        /* The shell keeps no pipe ends open in the children. */
+        int fd[2] = {-1, out_fd};
+        if (current < end) {
+            make_pipe(fd);
+        }
 
-                    if (current == i) {
-                        close(fd[0]);
-                        dup2(fd[1], STDOUT_FILENO);
+        pids[size + current - begin] = launch_cmd(&lineCmd->cmds.data[current], in_fd, fd[1],
+                                                  &pids[current - begin]);
 
-                        close(prev_fd[0]);
-                        close(prev_fd[1]);
-                    } else if (current == end) {
-                        close(prev_fd[1]);
-                        dup2(prev_fd[0], STDIN_FILENO);
+        if (current > begin) {
+            close(in_fd);
+        }
+        if (current < end) {
+            close(fd[1]);
+        }
+        in_fd = fd[0];
+    }
+}
 
-                        close(fd[0]);
-                        close(fd[1]);
-                        NEED_WRITE(current_cmd)
-                    } else {
-                        close(prev_fd[1]);
-                        close(fd[0]);
+/*
+ * Run the pipeline of cmds[begin..end]. Returns its exit status, or 0
+ * if it is left running in the background.
+ */
+int execute_pipeline(LineCmd *lineCmd, int begin, int end, int background) {
+    Cmd *last_cmd = &lineCmd->cmds.data[end];
+    if (last_cmd->last_elem == 0) {
+        return 0;
+    }
+    /* Alone, it runs in the shell: no fork, and cd and exit work. */
+    const Builtin *builtin = find_builtin(last_cmd);
+    if (begin == end && !background && builtin != NULL && last_cmd->redirect_count <= 1) {
+        return execute_builtin(builtin, last_cmd);
+    }
 
-                        dup2(prev_fd[0], STDIN_FILENO);
-                        dup2(fd[1], STDOUT_FILENO);
+    int count = 2 * (end - begin + 1);
+    pid_t *pids = arena_alloc(&line_arena, count * sizeof(pid_t));
+    if (background) {
+        int in_fd = open_background_stdin();
+        start_pipeline(lineCmd, begin, end, in_fd, STDOUT_FILENO, pids);
+        close(in_fd);
+        for (int j = 0; j < count; ++j) {
+            jobs_add(pids[j]);
+        }
+        return 0;
+    }
+    start_pipeline(lineCmd, begin, end, STDIN_FILENO, STDOUT_FILENO, pids);
+    int status = jobs_wait(pids, count);
+    return status;
+}
 
-                    }
+/*
+ * Run the pipelines of cmds[begin..end] joined by && and ||, each one
+ * only if the status so far allows. Returns the last status.
+ */
+int execute_and_or(LineCmd *lineCmd, int begin, int end) {
+    int status = 0;
+    NextCommand op = NONE;
+    for (int i = begin; i <= end;) {
+        int last = i;
+        while (last < end && lineCmd->nexts.data[last] == PIPE) ++last;
+
+        if (op == NONE || (op == AND) == (status == 0)) {
+            /* exit with no status in the list takes this one. */
+            status = last_status = execute_pipeline(lineCmd, i, last, 0);
+        }
+        op = lineCmd->nexts.data[last];
+        i = last + 1;
+    }
+    return status;
+}
 
-                    current_cmd->argv[current_cmd->last_elem] = NULL;
-                    execvp(current_cmd->argv[0], current_cmd->argv);
-                    exit(1);
-                }
-                close(prev_fd[0]);
-                close(prev_fd[1]);
-            }
-            for (int j = 0; j <= end - i; ++j) {
-                waitpid(pids[j], NULL, 0);
-            }
-            close(fd[0]);
-            close(fd[1]);
-            i = end;
+int is_pipeline(LineCmd *lineCmd, int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        if (lineCmd->nexts.data[i] != PIPE) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-            free(pids);
-        } else if (nextCommand == NONE) {
+/* Fork a shell to run the list cmds[begin..end] from in_fd to out_fd. */
+pid_t start_subshell(LineCmd *lineCmd, int begin, int end, int in_fd, int out_fd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        int status = execute_and_or(lineCmd, begin, end);
+        fflush(stdout);
+        _exit(status);
+    }
+    return pid;
+}
 
-            if (fork() == 0) {
-                Cmd *current_cmd = (Cmd *) get(&lineCmd.cmds, i);
+/* Run the list cmds[begin..end] ended by &, without waiting for it. */
+void execute_background(LineCmd *lineCmd, int begin, int end) {
+    if (is_pipeline(lineCmd, begin, end)) {
+        execute_pipeline(lineCmd, begin, end, 1);
+        return;
+    }
 
-                NEED_WRITE(current_cmd)
+    /* The conditions need a shell to check them: a subshell it is. */
+    int in_fd = open_background_stdin();
+    jobs_add(start_subshell(lineCmd, begin, end, in_fd, STDOUT_FILENO));
+    close(in_fd);
+}
 
-                current_cmd->argv[current_cmd->last_elem] = NULL;
-                execvp(current_cmd->argv[0], current_cmd->argv);
-                exit(1);
-            }
-            wait(NULL);
-        } else if (nextCommand == AND || nextCommand == OR) {
+void execute_line_cmd(LineCmd lineCmd) {
+    for (size_t i = 0; i < lineCmd.cmds.size;) {
+        size_t end = i;
+        while (lineCmd.nexts.data[end] != NONE) ++end;
+
+        if (lineCmd.cmds.data[end].background) {
+            execute_background(&lineCmd, i, end);
+        } else {
+            last_status = execute_and_or(&lineCmd, i, end);
+        }
+        i = end + 1;
+    }
+}
 
+/* The arguments and the redirect targets of the line, for the batch. */
+struct LineFiles_ {
+    char **words;
+    int word_count;
+    char **targets;
+    int target_count;
+} typedef LineFiles;
+
+void collect_line_files(LineCmd *lineCmd, LineFiles *files) {
+    int word_count = 0;
+    int target_count = 0;
+    for (size_t i = 0; i < lineCmd->cmds.size; ++i) {
+        word_count += lineCmd->cmds.data[i].last_elem;
+        target_count += lineCmd->cmds.data[i].redirect_count;
+    }
+    files->words = arena_alloc(&line_arena, word_count * sizeof(char *));
+    files->targets = arena_alloc(&line_arena, target_count * sizeof(char *));
+    files->word_count = 0;
+    files->target_count = 0;
+    for (size_t i = 0; i < lineCmd->cmds.size; ++i) {
+        Cmd *cmd = &lineCmd->cmds.data[i];
+        /* argv[0] is the program, not a file of the line. */
+        for (int j = 1; j < cmd->last_elem; ++j) {
+            files->words[files->word_count++] = cmd->argv[j];
+        }
+        for (int j = 0; j < cmd->redirect_count; ++j) {
+            files->targets[files->target_count++] = cmd->redirects[j].write_to_file;
         }
     }
 }
 
-void free_line_cmd(LineCmd *lineCmd) {
-    for(int i = 0; i < lineCmd->cmds.size; ++i) {
-        Cmd *cmd = get(&lineCmd->cmds, i);
-        for(int j = 0; j < cmd->last_elem; ++j) {
-            free(cmd->argv[j]);
+/*
+ * A line can run along with the others if it does not change the shell
+ * and touches no file which a running line writes. Files it reads are
+ * only guessed from its arguments.
+ */
+int is_independent(LineCmd *lineCmd, LineFiles *files) {
+    for (size_t i = 0; i < lineCmd->cmds.size; ++i) {
+        Cmd *cmd = &lineCmd->cmds.data[i];
+        const Builtin *builtin = find_builtin(cmd);
+        if (cmd->background || (builtin != NULL && builtin->changes_shell)) {
+            return 0;
         }
-        free(cmd->write_to_file);
     }
-    freeVector(&lineCmd->cmds);
-    freeVector(&lineCmd->nexts);
+    return !batch_conflicts(&batch, files->words, files->word_count,
+                            files->targets, files->target_count);
+}
+
+/* Start the line in the batch, its output is captured there. */
+void start_batch_line(LineCmd *lineCmd, LineFiles *files) {
+    batch_wait_slot(&batch);
+
+    int size = lineCmd->cmds.size;
+    int out[2];
+    make_pipe(out);
+    /* The script is on stdin, the lines must not eat it. */
+    int in_fd = open_background_stdin();
+    pid_t *pids;
+    int count;
+    if (is_pipeline(lineCmd, 0, size - 1)) {
+        count = 2 * size;
+        pids = arena_alloc(&line_arena, count * sizeof(pid_t));
+        start_pipeline(lineCmd, 0, size - 1, in_fd, out[1], pids);
+    } else {
+        count = 1;
+        pids = arena_alloc(&line_arena, sizeof(pid_t));
+        pids[0] = start_subshell(lineCmd, 0, size - 1, in_fd, out[1]);
+    }
+    close(in_fd);
+    close(out[1]);
+    batch_add(&batch, pids, count, out[0], files->words, files->word_count,
+              files->targets, files->target_count);
+}
+
+void execute_batch_line(LineCmd *lineCmd) {
+    if (lineCmd->cmds.size == 0) {
+        return;
+    }
+    LineFiles files;
+    collect_line_files(lineCmd, &files);
+    if (is_independent(lineCmd, &files)) {
+        start_batch_line(lineCmd, &files);
+        return;
+    }
+    /* The lines before it must be done, as if they ran one by one. */
+    last_status = batch_drain(&batch, last_status);
+    execute_line_cmd(*lineCmd);
+}
+
+/* Forget the line, keep the memory for the next one. */
+void reset_line_cmd(LineCmd *lineCmd) {
+    cmd_vec_clear(&lineCmd->cmds);
+    next_vec_clear(&lineCmd->nexts);
+    arena_reset(&line_arena);
 }
 
-int main() {
+/* A whole number in [1, max] and nothing else, 0 on success. */
+int parse_positive(const char *arg, long max, int *value) {
+    char *end;
+    errno = 0;
+    long number = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0 || number < 1 || number > max) {
+        return -1;
+    }
+    *value = (int) number;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int max_parallel = 0;
+    int pipe_size_kb = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "P:S:")) != -1) {
+        int rc = -1;
+        if (opt == 'P') {
+            rc = parse_positive(optarg, INT_MAX, &max_parallel);
+        } else if (opt == 'S') {
+            rc = parse_positive(optarg, INT_MAX / 1024, &pipe_size_kb);
+        }
+        if (rc != 0) {
+            printf("Usage: %s [-P max_parallel_lines] [-S pipe_size_kb]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_parallel > 0) {
+        batch_mode = 1;
+        batch_init(&batch, max_parallel);
+    }
+    pipe_size = pipe_size_kb * 1024;
+
+    LineCmd lineCmd;
+    init_line_cmd(&lineCmd);
+    arena_init(&line_arena);
+    lexer_init(&lexer, STDIN_FILENO);
+    token_vec_create(&tokens);
+    jobs_init();
 
     while (1) {
 //        printf("$> ");
 
-        char *line = read_line();
-        LineCmd lineCmd = parse(line);
-        free(line);
+        read_line();
+        parse(&lineCmd, &tokens);
 
 //        print_line_cmd(lineCmd);
-        execute_line_cmd(lineCmd);
+        if (batch_mode) {
+            execute_batch_line(&lineCmd);
+        } else {
+            execute_line_cmd(lineCmd);
+        }
 
 //        heaph_get_alloc_count();
 
-        free_line_cmd(&lineCmd);
+        reset_line_cmd(&lineCmd);
     }
 }
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "pathcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Where exec*p() looks if there is no $PATH. */
+#define PATHCACHE_DEFAULT_PATH "/bin:/usr/bin"
+#define PATHCACHE_MIN_BUCKETS 64
+
+struct PathEntry_ {
+    struct PathEntry_ *next;
+    unsigned hash;
+    /* Index of the directory the program is in. */
+    int dir;
+    char *name;
+    char *path;
+} typedef PathEntry;
+
+struct PathDir_ {
+    char *dir;
+    struct timespec mtime;
+} typedef PathDir;
+
+/* The $PATH the cache is for. */
+static char *path_value = NULL;
+static PathDir *dirs = NULL;
+static int dir_count = 0;
+static long long checked_ms = 0;
+
+static PathEntry **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t entry_count = 0;
+
+/* A program in a relative directory is not cached: cd moves it. */
+static char *uncached = NULL;
+
+static void *xmalloc(size_t size) {
+    void *result = malloc(size);
+    if (result == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+static unsigned hash_name(const char *name) {
+    /* FNV-1a. */
+    unsigned hash = 2166136261u;
+    for (; *name != '\0'; ++name) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    /* No syscall: the coarse clock is read from the vDSO. */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void free_entry(PathEntry *entry) {
+    free(entry->name);
+    free(entry->path);
+    free(entry);
+}
+
+/* Drop the programs found in the directory from_dir and the ones after it. */
+static void drop_entries(int from_dir) {
+    for (size_t i = 0; i < bucket_count; ++i) {
+        PathEntry **link = &buckets[i];
+        while (*link != NULL) {
+            PathEntry *entry = *link;
+            if (entry->dir >= from_dir) {
+                *link = entry->next;
+                free_entry(entry);
+                --entry_count;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+static void read_mtime(PathDir *dir) {
+    struct stat st;
+    if (stat(dir->dir[0] != '\0' ? dir->dir : ".", &st) == 0) {
+        dir->mtime = st.st_mtim;
+    } else {
+        dir->mtime = (struct timespec) {0, 0};
+    }
+}
+
+/* Split the new $PATH into the directories. */
+static void load_path(const char *value) {
+    for (int i = 0; i < dir_count; ++i) {
+        free(dirs[i].dir);
+    }
+    free(dirs);
+    free(path_value);
+    path_value = strdup(value);
+
+    dir_count = 1;
+    for (const char *c = value; *c != '\0'; ++c) {
+        dir_count += *c == ':';
+    }
+    dirs = xmalloc(dir_count * sizeof(PathDir));
+    const char *start = value;
+    for (int i = 0; i < dir_count; ++i) {
+        const char *end = strchrnul(start, ':');
+        dirs[i].dir = strndup(start, end - start);
+        read_mtime(&dirs[i]);
+        start = end + 1;
+    }
+    checked_ms = now_ms();
+}
+
+/* Drop what $PATH or its directories do not confirm any more. */
+static void check_path(void) {
+    const char *value = getenv("PATH");
+    if (value == NULL) {
+        value = PATHCACHE_DEFAULT_PATH;
+    }
+    if (path_value == NULL || strcmp(path_value, value) != 0) {
+        drop_entries(0);
+        load_path(value);
+        return;
+    }
+    long long now = now_ms();
+    if (now - checked_ms < PATHCACHE_CHECK_PERIOD_MS) {
+        return;
+    }
+    checked_ms = now;
+    int changed = dir_count;
+    for (int i = 0; i < dir_count; ++i) {
+        struct timespec old = dirs[i].mtime;
+        read_mtime(&dirs[i]);
+        if (changed == dir_count &&
+            (old.tv_sec != dirs[i].mtime.tv_sec || old.tv_nsec != dirs[i].mtime.tv_nsec)) {
+            changed = i;
+        }
+    }
+    drop_entries(changed);
+}
+
+static void grow_buckets(void) {
+    size_t count = bucket_count > 0 ? bucket_count * 2 : PATHCACHE_MIN_BUCKETS;
+    PathEntry **new_buckets = xmalloc(count * sizeof(PathEntry *));
+    memset(new_buckets, 0, count * sizeof(PathEntry *));
+    for (size_t i = 0; i < bucket_count; ++i) {
+        PathEntry *entry = buckets[i];
+        while (entry != NULL) {
+            PathEntry *next = entry->next;
+            PathEntry **bucket = &new_buckets[entry->hash & (count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    bucket_count = count;
+}
+
+static PathEntry **find(const char *name, unsigned hash) {
+    if (bucket_count == 0) {
+        return NULL;
+    }
+    PathEntry **link = &buckets[hash & (bucket_count - 1)];
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return *link != NULL ? link : NULL;
+}
+
+static int is_program(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* Search $PATH as exec*p() does, cache what is found. */
+static const char *search(const char *name, unsigned hash) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < dir_count; ++i) {
+        const char *dir = dirs[i].dir[0] != '\0' ? dirs[i].dir : ".";
+        size_t dir_len = strlen(dir);
+        char *path = xmalloc(dir_len + name_len + 2);
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+        if (!is_program(path)) {
+            free(path);
+            continue;
+        }
+        if (dir[0] != '/') {
+            free(uncached);
+            uncached = path;
+            return path;
+        }
+        if (entry_count >= bucket_count) {
+            grow_buckets();
+        }
+        PathEntry *entry = xmalloc(sizeof(PathEntry));
+        entry->hash = hash;
+        entry->dir = i;
+        entry->name = strdup(name);
+        entry->path = path;
+        PathEntry **bucket = &buckets[hash & (bucket_count - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        ++entry_count;
+        return path;
+    }
+    return NULL;
+}
+
+const char *pathcache_lookup(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    check_path();
+    unsigned hash = hash_name(name);
+    PathEntry **link = find(name, hash);
+    if (link != NULL) {
+        return (*link)->path;
+    }
+    return search(name, hash);
+}
+
+void pathcache_forget(const char *name) {
+    PathEntry **link = find(name, hash_name(name));
+    if (link != NULL) {
+        PathEntry *entry = *link;
+        *link = entry->next;
+        free_entry(entry);
+        --entry_count;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+/**
+ * @brief Cache of command name -> path of the program in $PATH, like
+ * the hash builtin of bash
+ *
+ * Without it every start searches $PATH by failed exec() calls in each
+ * directory before the right one. An entry is dropped when $PATH changes,
+ * when a directory in $PATH up to the one it was found in is modified
+ * (a new program could hide it), and when the program can not be
+ * started any more. The directories are checked at most once in
+ * PATHCACHE_CHECK_PERIOD_MS, so a program put into $PATH is seen that
+ * much later at worst.
+ */
+
+#define PATHCACHE_CHECK_PERIOD_MS 1000
+
+/**
+ * @brief Find the program to start for a command name
+ *
+ * @param name is the command name
+ * @return const char* path of the program, the name itself if it has a
+ * slash, NULL if there is no such program. Valid until the next call
+ */
+const char *pathcache_lookup(const char *name);
+
+/**
+ * @brief Drop the entry of a command, e.g. its program is gone
+ *
+ * @param name is the command name
+ */
+void pathcache_forget(const char *name);
+
+#endif // PATHCACHE_H
@@ -17,6 +17,7 @@ static char *(*default_strdup)(const char *) = NULL;
 static ssize_t (*default_getline)(char **, size_t *, FILE *) = NULL;
 
 static int64_t alloc_count = 0;
+static uint64_t alloc_total = 0;
 static bool global_lock = false;
 static __thread int depth = 0;
 
@@ -27,6 +28,7 @@ alloc_count_inc()
 		return;
 	assert(depth == 1);
 	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&alloc_total, 1, __ATOMIC_RELAXED);
 }
 
 static inline void
@@ -163,6 +165,8 @@ realloc(void *ptr, size_t size)
 	void *res = default_realloc(ptr, size);
 	if (ptr == NULL && res != NULL)
 		alloc_count_inc();
+	else if (res != NULL && depth == 1)
+		__atomic_add_fetch(&alloc_total, 1, __ATOMIC_RELAXED);
 	--depth;
 	return res;
 }
@@ -184,3 +188,9 @@ heaph_get_alloc_count(void)
 {
 	return (uint64_t)__atomic_load_n(&alloc_count, __ATOMIC_SEQ_CST);
 }
+
+uint64_t
+heaph_get_alloc_total(void)
+{
+	return __atomic_load_n(&alloc_total, __ATOMIC_RELAXED);
+}
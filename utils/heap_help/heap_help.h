@@ -4,3 +4,10 @@
 
 uint64_t
 heaph_get_alloc_count(void);
+
+/**
+ * Number of allocations done since the start, including the freed
+ * ones. A realloc of an existing block counts as one more.
+ */
+uint64_t
+heaph_get_alloc_total(void);
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Growable array of any type, specialized at compile time. The
+ * elements are stored by value in one contiguous allocation, so a
+ * push costs no malloc, except when the array doubles.
+ *
+ * VEC_DECL(int_vec, int) declares
+ *
+ *     struct int_vec {
+ *         int *data;
+ *         size_t size;
+ *         size_t capacity;
+ *     };
+ *
+ * and inline functions int_vec_create(), int_vec_destroy(),
+ * int_vec_reserve(), int_vec_push(), int_vec_append(),
+ * int_vec_pop(), int_vec_clear() and int_vec_shrink(). The same
+ * declaration can be repeated in several translation units.
+ *
+ * Running out of memory is fatal.
+ */
+
+#define VEC_MIN_CAPACITY 8
+
+#define VEC_DECL(name, type)						\
+struct name {								\
+	type *data;							\
+	size_t size;							\
+	size_t capacity;						\
+};									\
+									\
+/** Make an empty vector. Nothing is allocated yet. */		\
+static inline void							\
+name##_create(struct name *v)						\
+{									\
+	v->data = NULL;							\
+	v->size = 0;							\
+	v->capacity = 0;						\
+}									\
+									\
+/** Free the memory. The vector is empty and reusable then. */	\
+static inline void							\
+name##_destroy(struct name *v)						\
+{									\
+	free(v->data);							\
+	name##_create(v);						\
+}									\
+									\
+/** Make room for at least @a capacity elements. */			\
+static inline void							\
+name##_reserve(struct name *v, size_t capacity)			\
+{									\
+	if (capacity <= v->capacity)					\
+		return;							\
+	type *data = realloc(v->data, capacity * sizeof(type));		\
+	if (data == NULL) {						\
+		printf("Out of memory for %zu elements\n", capacity);	\
+		exit(-1);						\
+	}								\
+	v->data = data;							\
+	v->capacity = capacity;						\
+}									\
+									\
+/**									\
+ * Add an uninitialized element to the end, return it. The pointer	\
+ * is valid until the next growth.					\
+ */									\
+static inline type *							\
+name##_append(struct name *v)						\
+{									\
+	if (v->size == v->capacity) {					\
+		name##_reserve(v, v->capacity < VEC_MIN_CAPACITY ?	\
+			       VEC_MIN_CAPACITY : v->capacity * 2);	\
+	}								\
+	return &v->data[v->size++];					\
+}									\
+									\
+static inline void							\
+name##_push(struct name *v, type value)				\
+{									\
+	*name##_append(v) = value;					\
+}									\
+									\
+/** Remove the last element and return it. */			\
+static inline type							\
+name##_pop(struct name *v)						\
+{									\
+	return v->data[--v->size];					\
+}									\
+									\
+/** Remove all the elements, keep the memory. */			\
+static inline void							\
+name##_clear(struct name *v)						\
+{									\
+	v->size = 0;							\
+}									\
+									\
+/** Give back the memory not used by the elements. */		\
+static inline void							\
+name##_shrink(struct name *v)						\
+{									\
+	if (v->size == v->capacity)					\
+		return;							\
+	if (v->size == 0) {						\
+		name##_destroy(v);					\
+		return;							\
+	}								\
+	type *data = realloc(v->data, v->size * sizeof(type));		\
+	if (data != NULL) {						\
+		v->data = data;						\
+		v->capacity = v->size;					\
+	}								\
+}